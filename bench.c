@@ -0,0 +1,743 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <glob.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+
+#include "x-viredero.h"
+
+// Throughput benchmark without an X server. A synthetic scene (or a
+// sequence of P6 PPM screenshots) is drawn into a fake capture buffer and
+// each frame's damage goes through the real stages: fb_update and the
+// copy into jobs (capture), the encoder threads (encode) and a real
+// transport (send), with a sink on the far end of sockets and the shared
+// ring. Unlike the pump it never skips frames: when the pipeline or the
+// link is full it waits, so fps is what the stages can sustain.
+
+#define BENCH_FRAMES 300
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_MAX_PENDING 256
+#define BENCH_SHM_PATH "/tmp/x-viredero-bench.sock"
+#define MAX_ENCODER_THREADS 16
+
+struct samples {
+    unsigned long* v; // usec
+    long cnt;
+    long size;
+    pthread_mutex_t lock;
+};
+
+struct pending_frame {
+    unsigned long tail; // frame is out once the pipeline head gets here
+    unsigned long start;
+};
+
+struct bench {
+    int width;
+    int height;
+    int frames;
+    const char* scene;
+    uint32_t* screen; // what the "X server" shows, 32bpp xRGB
+    XImage image;
+    uint32_t** ppm; // preloaded frames, NULL for synthetic scenes
+    int ppm_cnt;
+    uint32_t seed;
+    int text_x; // typing cursor
+    int text_y;
+    int (*encode)(struct context*, struct encoder*, char*, int, char*, int, int, int);
+    bool (*write)(struct context*, int, int, int, int, char*, int);
+    bool (*write_prim)(struct context*, const struct primitive_msg*);
+    int primitives; // SF_PRIMITIVES with -P
+    int scale; // -S, the client gets the screen shrunk by this much
+    unsigned long bytes;
+    struct samples capture;
+    struct samples encode_time;
+    struct samples send;
+    struct samples frame;
+    struct pending_frame pend[BENCH_MAX_PENDING];
+    unsigned long pend_head;
+    unsigned long pend_tail;
+    pthread_t sink;
+    struct sockaddr_in tcp_addr;
+};
+
+static struct context context;
+static struct bench bench;
+
+static unsigned long usec_now() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000UL + tp.tv_nsec / 1000;
+}
+
+static void sample_add(struct samples* s, unsigned long usec) {
+    pthread_mutex_lock(&s->lock);
+    if (s->cnt == s->size) {
+        long size = MAX(1024, s->size * 2);
+        unsigned long* v = realloc(s->v, size * sizeof(*v));
+        if (NULL == v) {
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+        s->v = v;
+        s->size = size;
+    }
+    s->v[s->cnt++] = usec;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int cmp_ulong(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*)a;
+    unsigned long y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_stage(const char* name, struct samples* s) {
+    if (0 == s->cnt) {
+        printf("  %s -", name);
+        return;
+    }
+    qsort(s->v, s->cnt, sizeof(*s->v), cmp_ulong);
+    printf("  %s %lu/%lu", name, s->v[(s->cnt - 1) / 2], s->v[(s->cnt - 1) * 99 / 100]);
+    s->cnt = 0;
+}
+
+// stage hooks, encode runs on the worker threads
+static int timed_encode(struct context* ctx, struct encoder* enc, char* out, int out_size
+                        , char* src, int stride, int width, int height) {
+    unsigned long t = usec_now();
+    int len = bench.encode(ctx, enc, out, out_size, src, stride, width, height);
+    sample_add(&bench.encode_time, usec_now() - t);
+    return len;
+}
+
+static bool timed_write(struct context* ctx, int x, int y, int width, int height
+                        , char* data, int len) {
+    unsigned long t = usec_now();
+    bool res = bench.write(ctx, x, y, width, height, data, len);
+    sample_add(&bench.send, usec_now() - t);
+    bench.bytes += IMAGECMD_HEAD_LEN + len;
+    return res;
+}
+
+static bool timed_prim(struct context* ctx, const struct primitive_msg* pm) {
+    unsigned long t = usec_now();
+    bool res = bench.write_prim(ctx, pm);
+    sample_add(&bench.send, usec_now() - t);
+    bench.bytes += primcmd_len(pm);
+    return res;
+}
+
+static bool null_prim(struct context* ctx, const struct primitive_msg* pm) {
+    return true;
+}
+
+static bool null_write(struct context* ctx, int x, int y, int width, int height
+                       , char* data, int len) {
+    return true;
+}
+
+// scene drawing, deterministic so runs compare
+static uint32_t rnd() {
+    bench.seed = bench.seed * 1103515245 + 12345;
+    return bench.seed >> 8;
+}
+
+static void fill(int x, int y, int width, int height, uint32_t color) {
+    for (int j = y; j < y + height; j += 1) {
+        for (int i = x; i < x + width; i += 1) {
+            bench.screen[j * bench.width + i] = color;
+        }
+    }
+}
+
+// 8x16 cells of pseudo glyphs, dark on light
+static void text(int x, int y, int width, int height) {
+    for (int cy = y; cy + 16 <= y + height; cy += 16) {
+        for (int cx = x; cx + 8 <= x + width; cx += 8) {
+            uint32_t bits = rnd();
+            for (int j = 2; j < 14; j += 1) {
+                for (int i = 1; i < 7; i += 1) {
+                    bool on = (bits >> ((j * 7 + i) % 24)) & 1;
+                    bench.screen[(cy + j) * bench.width + cx + i] = on ? 0x202020 : 0xf8f8f8;
+                }
+            }
+        }
+    }
+}
+
+static void photo(int x, int y, int width, int height, int t) {
+    for (int j = y; j < y + height; j += 1) {
+        for (int i = x; i < x + width; i += 1) {
+            int r = 128 + 100 * sin((i + t * 5) / 41.0) + (rnd() & 15);
+            int g = 128 + 100 * sin((j - t * 3) / 29.0) + (rnd() & 15);
+            int b = 128 + 100 * sin((i + j + t * 7) / 53.0) + (rnd() & 15);
+            bench.screen[j * bench.width + i] = (r << 16) | (g << 8) | b;
+        }
+    }
+}
+
+static void damage(int x, int y, int width, int height) {
+    damage_add(&context.damage, x, y, MIN(width, bench.width - x), MIN(height, bench.height - y));
+}
+
+static void type_char() {
+    text(bench.text_x, bench.text_y, 8, 16);
+    damage(bench.text_x, bench.text_y, 8, 16);
+    bench.text_x += 8;
+    if (bench.text_x + 8 > MIN(bench.width, 800)) {
+        bench.text_x = 8;
+        bench.text_y = bench.text_y + 16 + 16 > bench.height ? 8 : bench.text_y + 16;
+    }
+}
+
+static void video(int frame, int width, int height) {
+    int x = (bench.width - MIN(width, bench.width)) / 2;
+    int y = (bench.height - MIN(height, bench.height)) / 2;
+    width = MIN(width, bench.width);
+    height = MIN(height, bench.height);
+    photo(x, y, width, height, frame);
+    damage(x, y, width, height);
+}
+
+static void scene_first() {
+    bench.seed = 1;
+    bench.text_x = 8;
+    bench.text_y = 8;
+    fill(0, 0, bench.width, bench.height, 0x3a6ea5);
+    fill(0, 0, MIN(bench.width, 800), bench.height, 0xf8f8f8);
+    text(0, 0, MIN(bench.width, 800), bench.height / 2);
+    damage(0, 0, bench.width, bench.height);
+}
+
+static void scene_step(int frame) {
+    const char* s = bench.scene;
+    if (0 == frame) {
+        scene_first();
+    } else if (0 == strcmp(s, "text")) {
+        type_char();
+    } else if (0 == strcmp(s, "scroll")) {
+        memmove(bench.screen, bench.screen + 16 * bench.width
+                , (size_t)(bench.height - 16) * bench.width * 4);
+        text(0, bench.height - 16, bench.width, 16);
+        damage(0, 0, bench.width, bench.height);
+    } else if (0 == strcmp(s, "video")) {
+        video(frame, 640, 360);
+    } else { // desktop: typing, a small video and now and then a new window
+        type_char();
+        video(frame, 480, 270);
+        if (0 == frame % 60) {
+            int w = MIN(800, bench.width);
+            int h = MIN(600, bench.height);
+            int x = rnd() % (bench.width - w + 1);
+            int y = rnd() % (bench.height - h + 1);
+            fill(x, y, w, h, 0xe0e0e0);
+            fill(x, y, w, 24, 0x305080);
+            text(x + 8, y + 32, w - 16, h - 40);
+            damage(x, y, w, h);
+        }
+    }
+}
+
+static void ppm_step(int frame) {
+    memcpy(bench.screen, bench.ppm[frame % bench.ppm_cnt], (size_t)bench.width * bench.height * 4);
+    damage(0, 0, bench.width, bench.height);
+}
+
+static uint32_t* load_ppm(const char* path) {
+    FILE* f = fopen(path, "rb");
+    uint32_t* pix = NULL;
+    int width, height;
+    if (NULL == f) {
+        return NULL;
+    }
+    if (fscanf(f, "P6 %d %d 255", &width, &height) == 2 && fgetc(f) != EOF
+        && (0 == bench.width || (width == bench.width && height == bench.height))) {
+        pix = malloc((size_t)width * height * 4);
+        for (long i = 0; pix != NULL && i < (long)width * height; i += 1) {
+            int r = fgetc(f);
+            int g = fgetc(f);
+            int b = fgetc(f);
+            pix[i] = (r << 16) | (g << 8) | b;
+        }
+        bench.width = width;
+        bench.height = height;
+    }
+    fclose(f);
+    return pix;
+}
+
+static bool load_ppms(const char* pattern) {
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0) {
+        fprintf(stderr, "No files match %s\n", pattern);
+        return false;
+    }
+    bench.width = 0;
+    bench.ppm = calloc(g.gl_pathc, sizeof(uint32_t*));
+    for (size_t i = 0; i < g.gl_pathc; i += 1) {
+        bench.ppm[bench.ppm_cnt] = load_ppm(g.gl_pathv[i]);
+        if (NULL == bench.ppm[bench.ppm_cnt]) {
+            fprintf(stderr, "Skipping %s: not a P6 PPM of the first file's size\n"
+                    , g.gl_pathv[i]);
+            continue;
+        }
+        bench.ppm_cnt += 1;
+    }
+    globfree(&g);
+    return bench.ppm_cnt > 0;
+}
+
+// the fake capture buffer as the X server would describe it
+static bool setup_screen() {
+    XImage* img = &bench.image;
+    bench.screen = malloc((size_t)bench.width * bench.height * 4);
+    if (NULL == bench.screen) {
+        return false;
+    }
+    memset(img, 0, sizeof(*img));
+    img->width = bench.width;
+    img->height = bench.height;
+    img->format = ZPixmap;
+    img->data = (char*)bench.screen;
+    img->byte_order = LSBFirst;
+    img->bitmap_unit = 32;
+    img->bitmap_bit_order = LSBFirst;
+    img->bitmap_pad = 32;
+    img->depth = 24;
+    img->bits_per_pixel = 32;
+    img->bytes_per_line = bench.width * 4;
+    img->red_mask = 0xFF0000;
+    img->green_mask = 0xFF00;
+    img->blue_mask = 0xFF;
+    if (!XInitImage(img)) {
+        return false;
+    }
+    encoder_visual(&context, img);
+    return true;
+}
+
+// far ends of the transports: take everything, look at nothing
+static void* tcp_sink(void* arg) {
+    char init[INIT_CMD_LEN] = {Init, 1, SF_RGB | SF_PNG | SF_WEBP | SF_MIXED, PF_RGBA};
+    static char buf[1024 * 1024];
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*)&bench.tcp_addr, sizeof(bench.tcp_addr)) < 0
+        || send(sock, init, sizeof(init), 0) != sizeof(init)) {
+        slog(LOG_ERR, "sink: cannot connect: %m");
+        return NULL;
+    }
+    while (recv(sock, buf, sizeof(buf), 0) > 0) {
+    }
+    close(sock);
+    return NULL;
+}
+
+// the memfd, the wakeup eventfd goes to *wakefd
+static int recv_fds(int sock, int* wakefd) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    int fds[2];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    struct msghdr mh;
+    struct cmsghdr* cm;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    if (recvmsg(sock, &mh, 0) != 1 || NULL == (cm = CMSG_FIRSTHDR(&mh))
+        || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    *wakefd = fds[1];
+    return fds[0];
+}
+
+// consumes by moving read_pos, the data itself is never touched
+static void* shm_sink(void* arg) {
+    char init[INIT_CMD_LEN] = {Init, 1, SF_RGB | SF_PNG | SF_WEBP | SF_MIXED, PF_RGBA};
+    struct sockaddr_un addr;
+    struct shm_ring* ring;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int fd;
+    int wakefd;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, BENCH_SHM_PATH);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || (fd = recv_fds(sock, &wakefd)) < 0
+        || MAP_FAILED == (ring = mmap(NULL, SHM_RING_HEAD_SIZE, PROT_READ | PROT_WRITE
+                                      , MAP_SHARED, fd, 0))
+        || send(sock, init, sizeof(init), 0) != sizeof(init)) {
+        slog(LOG_ERR, "sink: cannot attach to the ring: %m");
+        return NULL;
+    }
+    for (;;) {
+        struct timespec ts = {0, 10 * 1000000};
+        struct pollfd pfd = {sock, POLLIN, 0};
+        uint32_t seq;
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE) == ring->read_pos) {
+            syscall(SYS_futex, &ring->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+        }
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->read_pos, __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE)
+                         , __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST)) {
+            eventfd_write(wakefd, 1);
+        }
+        if (poll(&pfd, 1, 0) > 0) { // server closed
+            break;
+        }
+    }
+    close(wakefd);
+    close(sock);
+    return NULL;
+}
+
+// null, tcp, shm, rec:<file>, usb:<bus>.<port>
+static bool setup_backend(const char* spec) {
+    if (0 == strcmp(spec, "null")) {
+        context.write_image = null_write;
+        context.write_pointer = dummy_pointer_writer;
+        context.write_primitive = null_prim;
+    } else if (0 == strcmp(spec, "tcp")) {
+        socklen_t len = sizeof(bench.tcp_addr);
+        init_socket(&context, 0);
+        getsockname(context.w.sctx.listen_sock, (struct sockaddr*)&bench.tcp_addr, &len);
+        bench.tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        pthread_create(&bench.sink, NULL, tcp_sink, NULL);
+    } else if (0 == strcmp(spec, "shm")) {
+        init_shm(&context, BENCH_SHM_PATH);
+        pthread_create(&bench.sink, NULL, shm_sink, NULL);
+    } else if (0 == strncmp(spec, "rec:", 4)) {
+        init_rec(&context, spec + 4);
+#if WITH_USB
+    } else if (0 == strncmp(spec, "usb:", 4) && strchr(spec, '.') != NULL) {
+        init_usb(&context, strtol(spec + 4, NULL, 10), strtol(strchr(spec, '.') + 1, NULL, 10));
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool handshake(int format) {
+    char buf[MAX(MAX_INIT_BUF_SIZE, MAX_COMMAND_LEN)];
+    if (NULL == context.init_conn) {
+        return true;
+    }
+    if (!context.init_conn(&context, buf, sizeof(buf))) {
+        return false;
+    }
+    buf[0] = InitReply;
+    buf[1] = ResultSuccess;
+    buf[2] = format;
+    buf[3] = PF_RGBA;
+    ((int*)(buf + 4))[0] = htonl(bench.width / bench.scale);
+    ((int*)(buf + 4))[1] = htonl(bench.height / bench.scale);
+    return context.send_reply(&context, buf, 12);
+}
+
+// send what's encoded, note the frames that are completely out
+static void service() {
+    struct pipeline* pl = &context.pl;
+    pipeline_send_ready(&context);
+    if (context.flush_out) {
+        context.flush_out(&context);
+    }
+    trace_transport(&context);
+    stats_gauges(&context);
+    while (bench.pend_head != bench.pend_tail) {
+        struct pending_frame* f = &bench.pend[bench.pend_head % BENCH_MAX_PENDING];
+        if (pl->head < f->tail) {
+            break;
+        }
+        sample_add(&bench.frame, usec_now() - f->start);
+        bench.pend_head += 1;
+    }
+}
+
+// sleep until an encoder or the transport moves
+static void wait_progress() {
+    struct pollfd fds[LOOP_MAX_TRANSPORT_FDS + 1];
+    int cnt = context.poll_fds ? context.poll_fds(&context, fds + 1, LOOP_MAX_TRANSPORT_FDS) : 0;
+    eventfd_t junk;
+    fds[0].fd = context.pl.done_fd;
+    fds[0].events = POLLIN;
+    if (poll(fds, cnt + 1, 10) > 0 && (fds[0].revents & POLLIN)) {
+        eventfd_read(context.pl.done_fd, &junk);
+    }
+    service();
+}
+
+static bool busy() {
+    long backlog = (long)context.cfg.backlog_kb * 1024;
+    return context.pl.tail - context.pl.head > PIPELINE_DEPTH / 2
+        || bench.pend_tail - bench.pend_head == BENCH_MAX_PENDING
+        || (backlog > 0 && context.out_queued != NULL && context.out_queued(&context) > backlog);
+}
+
+static void run_frame(int frame) {
+    struct damage_region* dmg = &context.damage;
+    unsigned long start;
+    while (busy()) {
+        wait_progress();
+    }
+    if (bench.ppm != NULL) {
+        ppm_step(frame);
+    } else {
+        scene_step(frame);
+    }
+    // the X server would have the pixels ready in its shm segment
+    start = usec_now();
+    for (int i = 0; i < dmg->cnt; i += 1) {
+        XRectangle area = dmg->rects[i];
+        XRectangle* r = &area;
+        char* src;
+        int stride = bench.width * 4;
+        int cnt;
+        if (!fb_scale_rect(&context.fb, bench.scale, r)) {
+            continue;
+        }
+        src = (char*)(bench.screen + r->y * bench.scale * bench.width + r->x * bench.scale);
+        pipeline_begin_capture(&context, dmg->since, false);
+        if (bench.scale > 1
+            && reserve_buffer(&context.scaled, &context.scaled_size, r->width * r->height * 4)) {
+            downscale(src, stride, context.scaled, r->width * 4, r->width, r->height
+                      , bench.scale, 4);
+            src = context.scaled;
+            stride = r->width * 4;
+        }
+        motion_copy(&context, src, stride, r->x, r->y, r->width, r->height);
+        cnt = fb_update(&context.fb, src, stride, r->x, r->y, r->width, r->height);
+        for (int k = 0; k < cnt; k += 1) {
+            XRectangle* c = &context.fb.changed[k];
+            pipeline_submit_image(&context, c->x, c->y, c->width, c->height);
+        }
+    }
+    damage_clear(dmg);
+    sample_add(&bench.capture, usec_now() - start);
+    bench.pend[bench.pend_tail % BENCH_MAX_PENDING].tail = context.pl.tail;
+    bench.pend[bench.pend_tail % BENCH_MAX_PENDING].start = start;
+    bench.pend_tail += 1;
+    service();
+}
+
+static bool run(const char* name, int format, const char* backend) {
+    unsigned long start;
+    unsigned long elapsed;
+    if (!fb_init(&context.fb, bench.width / bench.scale, bench.height / bench.scale, 4) || !init_encoder(&context, format)) {
+        fprintf(stderr, "Cannot set up %s\n", name);
+        return false;
+    }
+    context.screen_format = format | bench.primitives;
+    bench.encode = context.encode_image;
+    context.encode_image = timed_encode;
+    bench.bytes = 0;
+    start = usec_now();
+    for (int i = 0; i < bench.frames; i += 1) {
+        run_frame(i);
+    }
+    pipeline_drain(&context);
+    while (context.out_queued != NULL && context.out_queued(&context) > 0) {
+        wait_progress();
+    }
+    service();
+    elapsed = MAX(usec_now() - start, 1);
+    printf("%-6s %-8s %4d frames %7.1f fps %8.1f MB/s %9lu B/frame", name, backend
+           , bench.frames, bench.frames * 1e6 / elapsed, bench.bytes / (double)elapsed
+           , bench.bytes / bench.frames);
+    print_stage("capture", &bench.capture);
+    print_stage("encode", &bench.encode_time);
+    print_stage("send", &bench.send);
+    print_stage("frame", &bench.frame);
+    printf("\n");
+    return true;
+}
+
+static const struct {
+    const char* name;
+    int format;
+} codecs[] = {
+    {"rgb", SF_RGB},
+    {"png", SF_PNG},
+    {"webp", SF_WEBP},
+    {"mixed", SF_MIXED | SF_RGB | SF_PNG | SF_WEBP},
+    {"delta", SF_DELTA},
+    {"yuv420", SF_YUV420},
+    {"rgb565", SF_RGB565},
+    {NULL, 0},
+};
+
+static void usage(const char* prog) {
+    fprintf(stderr, "USAGE: %s [-c rgb,png,webp,mixed,delta,yuv420,rgb565] [-P]"
+            " [-b null|tcp|shm|rec:<file>"
+#if WITH_USB
+            "|usb:<bus>.<port>"
+#endif
+            "]\n    [-s desktop|text|scroll|video | -g '<ppm glob>'] [-n frames]"
+            " [-W width -H height] [-S scale] [-j encoders]\n    [-o name=value] [-t <trace.json>]"
+            " [-m <stats socket>] [-d]\n"
+            "Prints fps, output MB/s, bytes per frame and p50/p99 usec of capture,"
+            " encode,\nsend (per message) and frame (damage to last byte handed to"
+            " the transport).\n-P adds CopyRect and FillRect (SF_PRIMITIVES) to every codec.\n"
+            "-S 2 sends the screen at half width and height, like a small client panel.\n"
+            , prog);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    const char* codec_list = "rgb,png,webp,mixed";
+    const char* backend = "null";
+    const char* ppm_glob = NULL;
+    const char* trace_path = NULL;
+    const char* stats_path = NULL;
+    long workers = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_ENCODER_THREADS);
+    char* list;
+    int c;
+
+    openlog("x-viredero-bench", LOG_PERROR, LOG_USER);
+    config_defaults(&context.cfg);
+    damage_init(&context.damage, 4096);
+    bench.width = BENCH_WIDTH;
+    bench.height = BENCH_HEIGHT;
+    bench.frames = BENCH_FRAMES;
+    bench.scene = "desktop";
+    bench.scale = 1;
+    while ((c = getopt(argc, argv, "dPc:b:s:g:n:W:H:S:j:m:o:t:")) != -1) {
+        switch (c) {
+        case 'd':
+            set_log_level(LOG_DEBUG);
+            break;
+        case 'P':
+            bench.primitives = SF_PRIMITIVES;
+            break;
+        case 'c':
+            codec_list = optarg;
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 's':
+            bench.scene = optarg;
+            break;
+        case 'g':
+            ppm_glob = optarg;
+            break;
+        case 'n':
+            bench.frames = MAX(1, strtol(optarg, NULL, 10));
+            break;
+        case 'W':
+            bench.width = MAX(64, strtol(optarg, NULL, 10));
+            break;
+        case 'H':
+            bench.height = MAX(64, strtol(optarg, NULL, 10));
+            break;
+        case 'S':
+            bench.scale = MAX(1, MIN(strtol(optarg, NULL, 10), 8));
+            break;
+        case 'j':
+            workers = MAX(0, MIN(strtol(optarg, NULL, 10), MAX_ENCODER_THREADS));
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'o':
+            if (!config_set(&context.cfg, optarg)) {
+                fprintf(stderr, "Bad option %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    context.scale = bench.scale;
+    if ((ppm_glob != NULL && !load_ppms(ppm_glob)) || !setup_screen()
+        || (trace_path != NULL && !trace_init(&context.trace, trace_path))
+        || !stats_init(stats_path)
+        || !pipeline_init(&context, workers)) {
+        return 1;
+    }
+    if (!setup_backend(backend)) {
+        usage(argv[0]);
+    }
+    bench.write = context.write_image;
+    context.write_image = timed_write;
+    bench.write_prim = context.write_primitive;
+    context.write_primitive = timed_prim;
+    if (!handshake(SF_RGB)) {
+        fprintf(stderr, "Handshake with %s failed\n", backend);
+        return 1;
+    }
+    printf("%dx%d %s, 1/%d scale, %d encoder threads, usec p50/p99\n", bench.width
+           , bench.height, ppm_glob ? ppm_glob : bench.scene, bench.scale, context.pl.nworkers);
+    list = strdup(codec_list);
+    for (char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int i = 0;
+        while (codecs[i].name != NULL && strcmp(codecs[i].name, name) != 0) {
+            i += 1;
+        }
+        if (NULL == codecs[i].name) {
+            usage(argv[0]);
+        }
+        if (!run(name, codecs[i].format, backend)) {
+            return 1;
+        }
+    }
+    pipeline_stop(&context);
+    if (context.close_out) {
+        context.close_out(&context);
+    }
+    trace_dump(&context.trace);
+    return 0;
+}
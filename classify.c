@@ -0,0 +1,142 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/param.h>
+
+#include <X11/Xutil.h>
+
+#include "x-viredero.h"
+
+// Guess what a rect shows from a sparse grid of its pixels:
+//  - tiny rects go raw, any codec header costs more than it saves
+//  - few distinct colors is text and UI chrome, PNG handles it well and fast
+//  - many colors, high luma entropy and neighbours that are close but
+//    rarely equal is a photo or video, lossy WebP is an order of magnitude
+//    smaller there
+//  - everything else (gradients, anti-aliased UI, text over pictures)
+//    is lossless WebP
+
+#define CLASSIFY_SAMPLES 4096
+#define CLASSIFY_RAW_PIXELS 256
+#define CLASSIFY_PALETTE_COLORS 64
+#define CLASSIFY_HASH_SIZE 256 // > CLASSIFY_PALETTE_COLORS, power of 2
+#define CLASSIFY_LUMA_BINS 64
+#define CLASSIFY_PHOTO_ENTROPY 4.0 // bits, out of log2(CLASSIFY_LUMA_BINS)
+#define CLASSIFY_SHARP_EDGE 96 // |dr| + |dg| + |db| between neighbours
+
+struct rect_stats {
+    uint32_t colors[CLASSIFY_HASH_SIZE];
+    int color_cnt;
+    int luma[CLASSIFY_LUMA_BINS];
+    int samples;
+    int sharp;
+    int repeats; // same as the pixel to the left or above
+};
+
+static uint32_t pixel_at(XImage* img, bool native, int x, int y) {
+    if (native) {
+        return ((const uint32_t*)(img->data + (long)y * img->bytes_per_line))[x] & 0xFFFFFF;
+    }
+    return XGetPixel(img, x, y) & 0xFFFFFF;
+}
+
+// distinct colors, counting stops once there are too many to matter
+static void add_color(struct rect_stats* st, uint32_t px) {
+    uint32_t i = (px * 2654435761u) >> 24;
+    if (st->color_cnt > CLASSIFY_PALETTE_COLORS) {
+        return;
+    }
+    for (;;) {
+        i &= CLASSIFY_HASH_SIZE - 1;
+        if (st->colors[i] == px) {
+            return;
+        }
+        if (st->colors[i] == UINT32_MAX) {
+            st->colors[i] = px;
+            st->color_cnt += 1;
+            return;
+        }
+        i += 1;
+    }
+}
+
+static int edge(uint32_t a, uint32_t b) {
+    return abs((int)(a >> 16 & 0xFF) - (int)(b >> 16 & 0xFF))
+        + abs((int)(a >> 8 & 0xFF) - (int)(b >> 8 & 0xFF))
+        + abs((int)(a & 0xFF) - (int)(b & 0xFF));
+}
+
+static double luma_entropy(const struct rect_stats* st) {
+    double e = 0;
+    for (int i = 0; i < CLASSIFY_LUMA_BINS; i += 1) {
+        if (st->luma[i] > 0) {
+            double p = (double)st->luma[i] / st->samples;
+            e -= p * log2(p);
+        }
+    }
+    return e;
+}
+
+enum ImageCodec classify_rect(XImage* img, bool native) {
+    struct rect_stats st;
+    int width = img->width;
+    int height = img->height;
+    int step;
+    if (width * height < CLASSIFY_RAW_PIXELS) {
+        return CodecRgb;
+    }
+    memset(st.colors, 0xFF, sizeof(st.colors));
+    memset(st.luma, 0, sizeof(st.luma));
+    st.color_cnt = 0;
+    st.samples = 0;
+    st.sharp = 0;
+    st.repeats = 0;
+    step = MAX(1, (int)sqrt((double)width * height / CLASSIFY_SAMPLES));
+    for (int y = step / 2; y < height; y += step) {
+        for (int x = step / 2; x < width; x += step) {
+            uint32_t px = pixel_at(img, native, x, y);
+            int l = ((px >> 16 & 0xFF) * 2 + (px >> 8 & 0xFF) * 5 + (px & 0xFF)) >> 3;
+            add_color(&st, px);
+            st.luma[l * CLASSIFY_LUMA_BINS / 256] += 1;
+            // compare with real neighbours, not with other samples
+            if (x > 0) {
+                uint32_t left = pixel_at(img, native, x - 1, y);
+                st.sharp += edge(px, left) > CLASSIFY_SHARP_EDGE;
+                st.repeats += px == left || (y > 0 && px == pixel_at(img, native, x, y - 1));
+            }
+            st.samples += 1;
+        }
+    }
+    if (st.color_cnt <= CLASSIFY_PALETTE_COLORS) {
+        return CodecPng;
+    }
+    if (st.sharp * 4 < st.samples && st.repeats * 2 < st.samples
+        && luma_entropy(&st) >= CLASSIFY_PHOTO_ENTROPY) {
+        return CodecWebpLossy;
+    }
+    return CodecWebpLossless;
+}
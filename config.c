@@ -0,0 +1,130 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "x-viredero.h"
+
+// -o name=value tunables, shared by everything that sets up a pipeline
+
+#define DEFAULT_PNG_LEVEL 1
+#define DEFAULT_PNG_FILTER PngFilterSub
+#define DEFAULT_WEBP_QUALITY 75
+#define DEFAULT_WEBP_METHOD 2 // 0 fastest .. 6 smallest
+#define DEFAULT_SOCK_QUEUE_KB (64 * 1024)
+#define DEFAULT_BACKLOG_KB 512
+#define DEFAULT_SOCK_CLIENTS 1
+#define DEFAULT_SHM_SIZE_MB 32
+#define DEFAULT_POINTER_HZ 120
+#define DEFAULT_BACKGROUND_MS 250
+#define DEFAULT_BACKGROUND_QUALITY 20
+#if WITH_LZ4
+#define DEFAULT_DELTA DeltaLz4
+#else
+#define DEFAULT_DELTA DeltaZstd
+#endif
+
+struct tunable {
+    char* name;
+    size_t offset; // of the int in struct config
+    int min;
+    int max;
+    const char* const* names; // symbolic values, index is the value
+};
+
+static const char* const png_filters[] = {"none", "sub", "up", "avg", "paeth", "adaptive", NULL};
+static const char* const webp_modes[] = {"lossy", "lossless", NULL};
+static const char* const delta_modes[] = {"lz4", "zstd", NULL};
+static const char* const dither_modes[] = {"off", "bayer", NULL};
+
+static const struct tunable tunables[] = {
+    {"png-level", offsetof(struct config, png_level), 0, 9, NULL},
+    {"png-filter", offsetof(struct config, png_filter), 0, PngFilterAdaptive, png_filters},
+    {"webp", offsetof(struct config, webp_lossless), 0, 1, webp_modes},
+    {"webp-quality", offsetof(struct config, webp_quality), 0, 100, NULL},
+    {"webp-method", offsetof(struct config, webp_method), 0, 6, NULL},
+    {"sock-sndbuf", offsetof(struct config, sock_sndbuf_kb), 0, 64 * 1024, NULL},
+    {"sock-queue", offsetof(struct config, sock_queue_kb), 1024, 1024 * 1024, NULL},
+    {"backlog", offsetof(struct config, backlog_kb), 0, 1024 * 1024, NULL},
+    {"sock-clients", offsetof(struct config, sock_clients), 1, SOCK_MAX_CLIENTS, NULL},
+    {"shm-size", offsetof(struct config, shm_size_mb), 1, 1024, NULL},
+    {"pointer-hz", offsetof(struct config, pointer_hz), 1, 1000, NULL},
+    {"delta", offsetof(struct config, delta), 0, DeltaZstd, delta_modes},
+    {"background-ms", offsetof(struct config, background_ms), 0, 60000, NULL},
+    {"background-quality", offsetof(struct config, background_quality), 0, 100, NULL},
+    {"dither", offsetof(struct config, dither), 0, DitherBayer, dither_modes},
+    {NULL, 0, 0, 0, NULL},
+};
+
+void config_defaults(struct config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->png_level = DEFAULT_PNG_LEVEL;
+    cfg->png_filter = DEFAULT_PNG_FILTER;
+    cfg->webp_quality = DEFAULT_WEBP_QUALITY;
+    cfg->webp_method = DEFAULT_WEBP_METHOD;
+    cfg->sock_queue_kb = DEFAULT_SOCK_QUEUE_KB;
+    cfg->backlog_kb = DEFAULT_BACKLOG_KB;
+    cfg->sock_clients = DEFAULT_SOCK_CLIENTS;
+    cfg->shm_size_mb = DEFAULT_SHM_SIZE_MB;
+    cfg->pointer_hz = DEFAULT_POINTER_HZ;
+    cfg->delta = DEFAULT_DELTA;
+    cfg->background_ms = DEFAULT_BACKGROUND_MS;
+    cfg->background_quality = DEFAULT_BACKGROUND_QUALITY;
+    cfg->dither = DitherBayer;
+}
+
+// opt is name=value
+bool config_set(struct config* cfg, const char* opt) {
+    const char* eq = strchr(opt, '=');
+    const struct tunable* t;
+    int* value;
+    if (NULL == eq) {
+        return false;
+    }
+    for (t = tunables; t->name != NULL; t += 1) {
+        if (strlen(t->name) == eq - opt && 0 == strncmp(t->name, opt, eq - opt)) {
+            break;
+        }
+    }
+    if (NULL == t->name) {
+        return false;
+    }
+    value = (int*)((char*)cfg + t->offset);
+    if (t->names != NULL) {
+        for (int i = 0; t->names[i] != NULL; i += 1) {
+            if (0 == strcmp(t->names[i], eq + 1)) {
+                *value = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    char* end;
+    long v = strtol(eq + 1, &end, 10);
+    if (*end != '\0' || v < t->min || v > t->max) {
+        return false;
+    }
+    *value = v;
+    return true;
+}
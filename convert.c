@@ -0,0 +1,605 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/param.h>
+
+#include <X11/Xutil.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+#include "x-viredero.h"
+
+// Kernels take 32bpp TrueColor pixels in the two byte orders X servers
+// use for depth 24/32: BGRX (LSBFirst) and XRGB (MSBFirst) and turn them
+// into 3 byte pixels, either in raw SF_RGB wire order (B, R, G - what
+// get_image_bmp has always produced) or in true R, G, B order for image
+// codecs. o0, o1, o2 are the source offsets of the three output bytes.
+
+#define SCALAR_ROW_KERNEL(name, o0, o1, o2)                             \
+    static void name##_scalar(const uint8_t* src, uint8_t* dst, int width) { \
+        for (int i = 0; i < width; i += 1) {                            \
+            dst[0] = src[o0];                                           \
+            dst[1] = src[o1];                                           \
+            dst[2] = src[o2];                                           \
+            src += 4;                                                   \
+            dst += 3;                                                   \
+        }                                                               \
+    }
+
+#if CONVERT_X86
+// Every store writes 16 (32) bytes for 12 (24) bytes of output. The tail
+// lands inside this row as long as enough pixels are left, the rest of
+// the row goes through the narrower kernel.
+__attribute__((target("ssse3")))
+static int shuffle_row_ssse3(const uint8_t* src, uint8_t* dst, int width, __m128i shuf) {
+    int i = 0;
+    for (; i + 6 <= width; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(px, shuf));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int shuffle_row_avx2(const uint8_t* src, uint8_t* dst, int width, __m256i shuf) {
+    // after the in-lane shuffle, move the upper lane's 12 bytes right
+    // behind the lower lane's
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i = 0;
+    for (; i + 11 <= width; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        px = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(px, shuf), compact);
+        _mm256_storeu_si256((__m256i*)(dst + i * 3), px);
+    }
+    return i;
+}
+
+// shuffle packs 4 pixels into the low 12 bytes of a lane; -1 zeroes a byte
+#define SHUF(o0, o1, o2) o0, o1, o2, o0 + 4, o1 + 4, o2 + 4, o0 + 8, o1 + 8, o2 + 8 \
+        , o0 + 12, o1 + 12, o2 + 12, -1, -1, -1, -1
+
+#define ROW_KERNELS(name, o0, o1, o2)                                   \
+    SCALAR_ROW_KERNEL(name, o0, o1, o2)                                 \
+    __attribute__((target("ssse3")))                                    \
+    static void name##_ssse3(const uint8_t* src, uint8_t* dst, int width) { \
+        int i = shuffle_row_ssse3(src, dst, width, _mm_setr_epi8(SHUF(o0, o1, o2))); \
+        name##_scalar(src + i * 4, dst + i * 3, width - i);             \
+    }                                                                   \
+    __attribute__((target("avx2")))                                     \
+    static void name##_avx2(const uint8_t* src, uint8_t* dst, int width) { \
+        int i = shuffle_row_avx2(src, dst, width                        \
+                                 , _mm256_setr_epi8(SHUF(o0, o1, o2), SHUF(o0, o1, o2))); \
+        name##_ssse3(src + i * 4, dst + i * 3, width - i);              \
+    }
+#else
+#define ROW_KERNELS(name, o0, o1, o2) SCALAR_ROW_KERNEL(name, o0, o1, o2)
+#endif /*CONVERT_X86*/
+
+ROW_KERNELS(bgrx_wire, 0, 2, 1)
+ROW_KERNELS(xrgb_wire, 3, 1, 2)
+ROW_KERNELS(bgrx_rgb, 2, 1, 0)
+ROW_KERNELS(xrgb_rgb, 1, 2, 3)
+
+struct row_kernels {
+    pixel_row_fn scalar;
+#if CONVERT_X86
+    pixel_row_fn ssse3;
+    pixel_row_fn avx2;
+#endif
+};
+
+#if CONVERT_X86
+#define KERNELS(name) {name##_scalar, name##_ssse3, name##_avx2}
+#else
+#define KERNELS(name) {name##_scalar}
+#endif
+
+// [order][msb]
+static const struct row_kernels kernels[2][2] = {
+    {KERNELS(bgrx_wire), KERNELS(xrgb_wire)},
+    {KERNELS(bgrx_rgb), KERNELS(xrgb_rgb)},
+};
+
+static bool is_truecolor32(const XImage* img, unsigned long red, unsigned long green
+                           , unsigned long blue) {
+    return img->format == ZPixmap && img->bits_per_pixel == 32
+        && (img->depth == 24 || img->depth == 32)
+        && img->red_mask == red && img->green_mask == green && img->blue_mask == blue;
+}
+
+pixel_row_fn select_rgb_converter(const XImage* img, enum RgbOrder order) {
+    const struct row_kernels* k;
+    if (!is_truecolor32(img, 0xFF0000, 0xFF00, 0xFF)) {
+        slog(LOG_NOTICE, "no fast path for %dbpp depth %d visual, using XGetPixel"
+             , img->bits_per_pixel, img->depth);
+        return NULL;
+    }
+    k = &kernels[order][img->byte_order == MSBFirst];
+#if CONVERT_X86
+    if (__builtin_cpu_supports("avx2")) {
+        slog(LOG_DEBUG, "pixel conversion: avx2");
+        return k->avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        slog(LOG_DEBUG, "pixel conversion: ssse3");
+        return k->ssse3;
+    }
+#endif
+    slog(LOG_DEBUG, "pixel conversion: scalar");
+    return k->scalar;
+}
+
+void rgb_row_copy(const uint8_t* src, uint8_t* dst, int width) {
+    memcpy(dst, src, width * 3);
+}
+
+void rgba_row_copy(const uint8_t* src, uint8_t* dst, int width) {
+    memcpy(dst, src, width * 4);
+}
+
+// runs on an encoder worker, the pipeline already keeps every core busy
+void convert_rgb(pixel_row_fn row, const char* src, int src_stride
+                 , char* dst, int width, int height) {
+    for (int j = 0; j < height; j += 1) {
+        row((const uint8_t*)src + (long)j * src_stride, (uint8_t*)dst + (long)j * width * 3
+            , width);
+    }
+}
+
+void convert_ximage_rgb(XImage* ximage, pixel_row_fn row, enum RgbOrder order
+                        , char* out, int width, int height) {
+    if (row) {
+        convert_rgb(row, ximage->data, ximage->bytes_per_line, out, width, height);
+        return;
+    }
+    for (int j = 0; j < height; j += 1) {
+        for (int i = 0; i < width; i += 1) {
+            unsigned long pixel = XGetPixel(ximage, i, j);
+            if (RgbWire == order) {
+                out[0] = pixel & 0xFF;
+                out[1] = (pixel >> 16) & 0xFF;
+                out[2] = (pixel >> 8) & 0xFF;
+            } else {
+                out[0] = (pixel >> 16) & 0xFF;
+                out[1] = (pixel >> 8) & 0xFF;
+                out[2] = pixel & 0xFF;
+            }
+            out += 3;
+        }
+    }
+}
+
+// one pixel as X stores it, 0xRRGGBB the way the XGetPixel path reads it
+uint32_t pixel_rgb(const XImage* img, const char* pixel) {
+    const uint8_t* p = (const uint8_t*)pixel;
+    int bpp = img->bits_per_pixel / 8;
+    uint32_t v = 0;
+    for (int i = 0; i < bpp; i += 1) {
+        v |= (uint32_t)p[i] << (MSBFirst == img->byte_order ? (bpp - 1 - i) * 8 : i * 8);
+    }
+    return v & 0xFFFFFF;
+}
+
+// WebP takes opaque 0xAARRGGBB words, servers storing XRGB in host byte
+// order only need the alpha byte filled in
+bool is_native_argb(const XImage* img) {
+    const uint32_t one = 1;
+    int host_order = *(const uint8_t*)&one ? LSBFirst : MSBFirst;
+    return is_truecolor32(img, 0xFF0000, 0xFF00, 0xFF) && img->byte_order == host_order;
+}
+
+void convert_ximage_argb(XImage* ximage, bool native, uint32_t* out, int width, int height) {
+    for (int j = 0; j < height; j += 1) {
+        if (native) {
+            const uint32_t* src = (const uint32_t*)(ximage->data + (long)j * ximage->bytes_per_line);
+            for (int i = 0; i < width; i += 1) {
+                out[i] = src[i] | 0xFF000000;
+            }
+        } else {
+            for (int i = 0; i < width; i += 1) {
+                unsigned long pixel = XGetPixel(ximage, i, j);
+                out[i] = 0xFF000000 | (pixel & 0xFFFFFF);
+            }
+        }
+        out += width;
+    }
+}
+
+// cursor pixels come as one ARGB value per unsigned long, the client
+// wants them as R, G, B, A bytes
+static int cursor_rgba_simd(const unsigned long* src, uint8_t* dst, int count);
+
+void cursor_to_rgba(const unsigned long* src, char* rgba, int count) {
+    uint8_t* dst = (uint8_t*)rgba;
+    int i = cursor_rgba_simd(src, dst, count);
+    for (; i < count; i += 1) {
+        uint32_t argb = src[i];
+        dst[i * 4 + 0] = argb >> 16;
+        dst[i * 4 + 1] = argb >> 8;
+        dst[i * 4 + 2] = argb;
+        dst[i * 4 + 3] = argb >> 24;
+    }
+}
+
+#if CONVERT_X86
+__attribute__((target("ssse3")))
+static int cursor_rgba_ssse3(const unsigned long* src, uint8_t* dst, int count) {
+    int i = 0;
+    if (sizeof(unsigned long) == 8) {
+        // two pixels per load, every pixel followed by 4 zero bytes
+        const __m128i lo = _mm_setr_epi8(2, 1, 0, 3, 10, 9, 8, 11
+                                         , -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1
+                                         , 2, 1, 0, 3, 10, 9, 8, 11);
+        for (; i + 4 <= count; i += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 2));
+            __m128i px = _mm_or_si128(_mm_shuffle_epi8(a, lo), _mm_shuffle_epi8(b, hi));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), px);
+        }
+    } else {
+        const __m128i shuf = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7
+                                           , 10, 9, 8, 11, 14, 13, 12, 15);
+        for (; i + 4 <= count; i += 4) {
+            __m128i px = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(px, shuf));
+        }
+    }
+    return i;
+}
+
+static int cursor_rgba_simd(const unsigned long* src, uint8_t* dst, int count) {
+    if (__builtin_cpu_supports("ssse3")) {
+        return cursor_rgba_ssse3(src, dst, count);
+    }
+    return 0;
+}
+#else
+static int cursor_rgba_simd(const unsigned long* src, uint8_t* dst, int count) {
+    return 0;
+}
+#endif /*CONVERT_X86*/
+
+// Raw formats for clients that convert on the GPU. Both take BGRX, what
+// a native 32 bpp visual captures. YUV420 is BT.601 video range, the
+// chroma of a 2x2 block comes from its summed RGB.
+static int yuv_luma_simd(const uint8_t* src, uint8_t* y, int width);
+static int yuv_chroma_simd(const uint8_t* a, const uint8_t* b, uint8_t* u, uint8_t* v
+                           , int width);
+
+static void yuv_luma_row(const uint8_t* src, uint8_t* y, int from, int width) {
+    for (int i = from; i < width; i += 1) {
+        const uint8_t* p = src + i * 4;
+        y[i] = ((66 * p[2] + 129 * p[1] + 25 * p[0] + 128) >> 8) + 16;
+    }
+}
+
+// a and b are the two rows, the same one at an odd bottom edge; an odd
+// right edge counts its last pixel twice
+static void yuv_chroma_row(const uint8_t* a, const uint8_t* b, uint8_t* u, uint8_t* v
+                           , int from, int width) {
+    for (int i = from; i < (width + 1) / 2; i += 1) {
+        int l = i * 8;
+        int r = 2 * i + 1 < width ? l + 4 : l;
+        int sb = a[l] + a[r] + b[l] + b[r];
+        int sg = a[l + 1] + a[r + 1] + b[l + 1] + b[r + 1];
+        int sr = a[l + 2] + a[r + 2] + b[l + 2] + b[r + 2];
+        u[i] = ((-38 * sr - 74 * sg + 112 * sb + 512) >> 10) + 128;
+        v[i] = ((112 * sr - 94 * sg - 18 * sb + 512) >> 10) + 128;
+    }
+}
+
+// out is the Y plane, then U and V at (width + 1) / 2 x (height + 1) / 2
+void convert_yuv420(const char* bgrx, int stride, char* out, int width, int height) {
+    int cw = (width + 1) / 2;
+    uint8_t* y = (uint8_t*)out;
+    uint8_t* u = y + width * height;
+    uint8_t* v = u + cw * ((height + 1) / 2);
+    for (int j = 0; j < height; j += 2) {
+        const uint8_t* a = (const uint8_t*)bgrx + (long)j * stride;
+        const uint8_t* b = j + 1 < height ? a + stride : a;
+        uint8_t* ya = y + (long)j * width;
+        yuv_luma_row(a, ya, yuv_luma_simd(a, ya, width), width);
+        if (b != a) {
+            yuv_luma_row(b, ya + width, yuv_luma_simd(b, ya + width, width), width);
+        }
+        uint8_t* ur = u + (long)j / 2 * cw;
+        uint8_t* vr = v + (long)j / 2 * cw;
+        yuv_chroma_row(a, b, ur, vr, yuv_chroma_simd(a, b, ur, vr, width), width);
+    }
+}
+
+static const uint8_t bayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5},
+};
+
+// What goes onto B, G, R, X of four pixels before they are cut to 5, 6
+// and 5 bits: up to one step less a bit, so truncating rounds on average.
+// Pinned to x, y on screen, rects sent apart show one pattern.
+static void dither_pattern(uint8_t* pattern, int x, int y, bool dither) {
+    for (int k = 0; k < 4; k += 1) {
+        int t = dither ? bayer[y & 3][(x + k) & 3] : 0;
+        pattern[k * 4 + 0] = t >> 1;
+        pattern[k * 4 + 1] = t >> 2;
+        pattern[k * 4 + 2] = t >> 1;
+        pattern[k * 4 + 3] = 0;
+    }
+}
+
+static int rgb565_row_simd(const uint8_t* src, uint8_t* dst, int width, const uint8_t* pattern);
+
+static void rgb565_row(const uint8_t* src, uint8_t* dst, int from, int width
+                       , const uint8_t* pattern) {
+    for (int i = from; i < width; i += 1) {
+        const uint8_t* d = pattern + (i & 3) * 4;
+        int b = MIN(255, src[i * 4] + d[0]) >> 3;
+        int g = MIN(255, src[i * 4 + 1] + d[1]) >> 2;
+        int r = MIN(255, src[i * 4 + 2] + d[2]) >> 3;
+        int px = r << 11 | g << 5 | b;
+        dst[i * 2] = px;
+        dst[i * 2 + 1] = px >> 8;
+    }
+}
+
+void convert_rgb565(const char* bgrx, int stride, char* out, int width, int height
+                    , int x, int y, bool dither) {
+    uint8_t pattern[16];
+    for (int j = 0; j < height; j += 1) {
+        const uint8_t* src = (const uint8_t*)bgrx + (long)j * stride;
+        uint8_t* dst = (uint8_t*)out + (long)j * width * 2;
+        dither_pattern(pattern, x, y + j, dither);
+        rgb565_row(src, dst, rgb565_row_simd(src, dst, width, pattern), width, pattern);
+    }
+}
+
+#if CONVERT_X86
+// 8 Y per step, B, G, R, X times the weights added up pairwise
+__attribute__((target("ssse3")))
+static int yuv_luma_ssse3(const uint8_t* src, uint8_t* y, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coef = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i offset = _mm_set1_epi16(16);
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 4 + 16));
+        __m128i ya = _mm_hadd_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(a, zero), coef)
+                                    , _mm_madd_epi16(_mm_unpackhi_epi8(a, zero), coef));
+        __m128i yb = _mm_hadd_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(b, zero), coef)
+                                    , _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), coef));
+        ya = _mm_srai_epi32(_mm_add_epi32(ya, round), 8);
+        yb = _mm_srai_epi32(_mm_add_epi32(yb, round), 8);
+        __m128i y16 = _mm_add_epi16(_mm_packs_epi32(ya, yb), offset);
+        _mm_storel_epi64((__m128i*)(y + i), _mm_packus_epi16(y16, y16));
+    }
+    return i;
+}
+
+// 4 U and V per step: 2x2 sums as in half_rows_sse2, then the weights
+__attribute__((target("ssse3")))
+static int yuv_chroma_ssse3(const uint8_t* a, const uint8_t* b, uint8_t* u, uint8_t* v
+                            , int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ucoef = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+    const __m128i vcoef = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+    const __m128i round = _mm_set1_epi32(512);
+    const __m128i offset = _mm_set1_epi16(128);
+    int i = 0;
+    for (; 2 * i + 8 <= width; i += 4) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(a + i * 8));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(a + i * 8 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(b + i * 8));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(b + i * 8 + 16));
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+        s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+        s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+        s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+        __m128i lo = _mm_unpacklo_epi64(s0, s1);
+        __m128i hi = _mm_unpacklo_epi64(s2, s3);
+        __m128i cu = _mm_hadd_epi32(_mm_madd_epi16(lo, ucoef), _mm_madd_epi16(hi, ucoef));
+        __m128i cv = _mm_hadd_epi32(_mm_madd_epi16(lo, vcoef), _mm_madd_epi16(hi, vcoef));
+        cu = _mm_srai_epi32(_mm_add_epi32(cu, round), 10);
+        cv = _mm_srai_epi32(_mm_add_epi32(cv, round), 10);
+        __m128i c16 = _mm_add_epi16(_mm_packs_epi32(cu, cv), offset);
+        __m128i c8 = _mm_packus_epi16(c16, c16);
+        int uw = _mm_cvtsi128_si32(c8);
+        int vw = _mm_cvtsi128_si32(_mm_srli_si128(c8, 4));
+        memcpy(u + i, &uw, 4);
+        memcpy(v + i, &vw, 4);
+    }
+    return i;
+}
+
+static int yuv_luma_simd(const uint8_t* src, uint8_t* y, int width) {
+    if (__builtin_cpu_supports("ssse3")) {
+        return yuv_luma_ssse3(src, y, width);
+    }
+    return 0;
+}
+
+static int yuv_chroma_simd(const uint8_t* a, const uint8_t* b, uint8_t* u, uint8_t* v
+                           , int width) {
+    if (__builtin_cpu_supports("ssse3")) {
+        return yuv_chroma_ssse3(a, b, u, v, width);
+    }
+    return 0;
+}
+
+// dithered pixels cut to 5, 6, 5 bits in their 32 bit lanes; sign
+// extended, so the signed pack keeps all 16 bits
+__attribute__((target("sse2")))
+static inline __m128i rgb565_lanes_sse2(__m128i px) {
+    __m128i r = _mm_and_si128(_mm_srli_epi32(px, 8), _mm_set1_epi32(0xf800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(px, 5), _mm_set1_epi32(0x07e0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(px, 3), _mm_set1_epi32(0x001f));
+    return _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(r, _mm_or_si128(g, b)), 16), 16);
+}
+
+__attribute__((target("sse2")))
+static int rgb565_row_sse2(const uint8_t* src, uint8_t* dst, int width, const uint8_t* pattern) {
+    const __m128i d = _mm_loadu_si128((const __m128i*)pattern);
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m128i a = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(src + i * 4)), d);
+        __m128i b = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(src + i * 4 + 16)), d);
+        _mm_storeu_si128((__m128i*)(dst + i * 2)
+                         , _mm_packs_epi32(rgb565_lanes_sse2(a), rgb565_lanes_sse2(b)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rgb565_lanes_avx2(__m256i px) {
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(px, 8), _mm256_set1_epi32(0xf800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 5), _mm256_set1_epi32(0x07e0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 3), _mm256_set1_epi32(0x001f));
+    return _mm256_srai_epi32(_mm256_slli_epi32(_mm256_or_si256(r, _mm256_or_si256(g, b)), 16)
+                             , 16);
+}
+
+// the pack works per 128 bit lane, the permute puts the pixels back in order
+__attribute__((target("avx2")))
+static int rgb565_row_avx2(const uint8_t* src, uint8_t* dst, int width, const uint8_t* pattern) {
+    const __m256i d = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pattern));
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m256i a = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i*)(src + i * 4)), d);
+        __m256i b = _mm256_adds_epu8(_mm256_loadu_si256((const __m256i*)(src + i * 4 + 32)), d);
+        __m256i px = _mm256_packs_epi32(rgb565_lanes_avx2(a), rgb565_lanes_avx2(b));
+        _mm256_storeu_si256((__m256i*)(dst + i * 2), _mm256_permute4x64_epi64(px, 0xd8));
+    }
+    return i;
+}
+
+static int rgb565_row_simd(const uint8_t* src, uint8_t* dst, int width, const uint8_t* pattern) {
+    int i = 0;
+    if (__builtin_cpu_supports("avx2")) {
+        i = rgb565_row_avx2(src, dst, width, pattern);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        i += rgb565_row_sse2(src + i * 4, dst + i * 2, width - i, pattern);
+    }
+    return i;
+}
+#else
+static int yuv_luma_simd(const uint8_t* src, uint8_t* y, int width) {
+    return 0;
+}
+
+static int yuv_chroma_simd(const uint8_t* a, const uint8_t* b, uint8_t* u, uint8_t* v
+                           , int width) {
+    return 0;
+}
+
+static int rgb565_row_simd(const uint8_t* src, uint8_t* dst, int width, const uint8_t* pattern) {
+    return 0;
+}
+#endif /*CONVERT_X86*/
+
+// Box filter for the client panel: every scale x scale block of src
+// becomes one dst pixel. Bytes are averaged one by one, which is right
+// for the 24 and 32 bpp visuals scaling is allowed on.
+static int half_rows_simd(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width, int bpp);
+
+static void box_rows(const uint8_t* src, int src_stride, uint8_t* dst, int from, int width
+                     , int scale, int bpp) {
+    int n = scale * scale;
+    for (int i = from; i < width; i += 1) {
+        for (int c = 0; c < bpp; c += 1) {
+            const uint8_t* p = src + i * scale * bpp + c;
+            unsigned sum = n / 2;
+            for (int dy = 0; dy < scale; dy += 1) {
+                for (int dx = 0; dx < scale; dx += 1) {
+                    sum += p[dx * bpp];
+                }
+                p += src_stride;
+            }
+            dst[i * bpp + c] = sum / n;
+        }
+    }
+}
+
+void downscale(const char* src, int src_stride, char* dst, int dst_stride
+               , int width, int height, int scale, int bpp) {
+    for (int j = 0; j < height; j += 1) {
+        const uint8_t* row = (const uint8_t*)src + (long)j * scale * src_stride;
+        uint8_t* out = (uint8_t*)dst + (long)j * dst_stride;
+        int i = 2 == scale ? half_rows_simd(row, row + src_stride, out, width, bpp) : 0;
+        box_rows(row, src_stride, out, i, width, scale, bpp);
+    }
+}
+
+#if CONVERT_X86
+// four 2x2 blocks per step: widen to 16 bits, add the rows, then the
+// two pixels of every block, round and pack
+__attribute__((target("sse2")))
+static int half_rows_sse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 4 <= width; i += 4) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(a + i * 8));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(a + i * 8 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(b + i * 8));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(b + i * 8 + 16));
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+        s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+        s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+        s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), two), 2);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), two), 2);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+static int half_rows_simd(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width, int bpp) {
+    if (4 == bpp && __builtin_cpu_supports("sse2")) {
+        return half_rows_sse2(a, b, dst, width);
+    }
+    return 0;
+}
+#else
+static int half_rows_simd(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width, int bpp) {
+    return 0;
+}
+#endif /*CONVERT_X86*/
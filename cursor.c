@@ -0,0 +1,88 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "x-viredero.h"
+
+// Which shape sits in which of the client's PF_CACHE slots. XFixes gives
+// every cursor created a new serial, so shapes are also matched by a hash
+// of their pixels: an application bringing back the same arrow as a new
+// cursor costs the client a slot number, not the image.
+
+void cursor_cache_reset(struct cursor_cache* cc) {
+    memset(cc, 0, sizeof(*cc));
+}
+
+// FNV-1a over size and pixels, never 0
+uint64_t cursor_hash(const char* rgba, int width, int height) {
+    uint64_t h = 14695981039346656037ULL;
+    int size[2] = {width, height};
+    const uint8_t* p = (const uint8_t*)size;
+    for (unsigned i = 0; i < sizeof(size); i += 1) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    p = (const uint8_t*)rgba;
+    for (long i = 0; i < 4L * width * height; i += 1) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return 0 == h ? 1 : h;
+}
+
+// slot of the shape last seen as cursor serial, -1 if there's none
+int cursor_cache_find(struct cursor_cache* cc, unsigned long serial) {
+    for (int i = 0; i < POINTER_CACHE_SLOTS; i += 1) {
+        struct cursor_slot* s = &cc->slots[i];
+        if (s->hash != 0 && s->serial == serial) {
+            cc->clock += 1;
+            s->used = cc->clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// slot for the shape, *fresh when the client doesn't have it there yet
+int cursor_cache_put(struct cursor_cache* cc, unsigned long serial, uint64_t hash, bool* fresh) {
+    int oldest = 0;
+    cc->clock += 1;
+    for (int i = 0; i < POINTER_CACHE_SLOTS; i += 1) {
+        struct cursor_slot* s = &cc->slots[i];
+        if (s->hash == hash) {
+            s->serial = serial;
+            s->used = cc->clock;
+            *fresh = false;
+            return i;
+        }
+        // free slots were never used, they go first
+        if (s->used < cc->slots[oldest].used) {
+            oldest = i;
+        }
+    }
+    cc->slots[oldest].serial = serial;
+    cc->slots[oldest].hash = hash;
+    cc->slots[oldest].used = cc->clock;
+    *fresh = true;
+    return oldest;
+}
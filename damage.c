@@ -0,0 +1,202 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/param.h>
+
+#include "x-viredero.h"
+
+// Pending damage is kept as a short list of rectangles. Every rectangle
+// costs one capture + encode + transport message, which we value as
+// rect_cost pixels. Two rectangles are merged into their bounding
+// box whenever the pixels the box adds are cheaper than one more message.
+
+static long area(const XRectangle* r) {
+    return (long)r->width * r->height;
+}
+
+static void bounding_box(const XRectangle* a, const XRectangle* b, XRectangle* out) {
+    int x1 = MIN(a->x, b->x);
+    int y1 = MIN(a->y, b->y);
+    int x2 = MAX(a->x + a->width, b->x + b->width);
+    int y2 = MAX(a->y + a->height, b->y + b->height);
+    out->x = x1;
+    out->y = y1;
+    out->width = x2 - x1;
+    out->height = y2 - y1;
+}
+
+static long overlap(const XRectangle* a, const XRectangle* b) {
+    int w = MIN(a->x + a->width, b->x + b->width) - MAX(a->x, b->x);
+    int h = MIN(a->y + a->height, b->y + b->height) - MAX(a->y, b->y);
+    return (w > 0 && h > 0) ? (long)w * h : 0;
+}
+
+// extra pixels we have to send if a and b are replaced by their bounding box
+// minus the per-message overhead that merge saves
+static long merge_cost(const XRectangle* a, const XRectangle* b, int rect_cost) {
+    XRectangle box;
+    bounding_box(a, b, &box);
+    return area(&box) - (area(a) + area(b) - overlap(a, b)) - rect_cost;
+}
+
+void damage_init(struct damage_region* dmg, int rect_cost) {
+    dmg->cnt = 0;
+    dmg->rect_cost = rect_cost;
+    dmg->superseded = 0;
+}
+
+static void add(struct damage_region* dmg, int x, int y, int width, int height) {
+    XRectangle r;
+    int i;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    if (0 == dmg->cnt) {
+        dmg->since = now_usec();
+    }
+    r.x = x;
+    r.y = y;
+    r.width = width;
+    r.height = height;
+    // absorbing one rect may make the grown one worth merging with
+    // another, so keep going until nothing is cheap to merge
+    for (i = 0; i < dmg->cnt; i += 1) {
+        if (overlap(&r, &dmg->rects[i]) > 0) {
+            // pixels queued but not captured yet, they'll go out as one
+            dmg->superseded += 1;
+            break;
+        }
+    }
+    i = 0;
+    while (i < dmg->cnt) {
+        if (merge_cost(&r, &dmg->rects[i], dmg->rect_cost) <= 0) {
+            bounding_box(&r, &dmg->rects[i], &r);
+            metric_add(MetricCoalesced, 1);
+            dmg->cnt -= 1;
+            dmg->rects[i] = dmg->rects[dmg->cnt];
+            i = 0;
+        } else {
+            i += 1;
+        }
+    }
+    if (dmg->cnt == DAMAGE_MAX_RECTS) {
+        // out of slots: fold into the rect where it hurts least
+        int best = 0;
+        long best_cost = merge_cost(&r, &dmg->rects[0], dmg->rect_cost);
+        for (i = 1; i < dmg->cnt; i += 1) {
+            long cost = merge_cost(&r, &dmg->rects[i], dmg->rect_cost);
+            if (cost < best_cost) {
+                best = i;
+                best_cost = cost;
+            }
+        }
+        bounding_box(&r, &dmg->rects[best], &dmg->rects[best]);
+        metric_add(MetricCoalesced, 1);
+        return;
+    }
+    dmg->rects[dmg->cnt] = r;
+    dmg->cnt += 1;
+}
+
+void damage_add(struct damage_region* dmg, int x, int y, int width, int height) {
+    metric_add(MetricDamageRects, 1);
+    add(dmg, x, y, width, height);
+}
+
+// pixels owed to the client for some other reason than X damage
+void damage_requeue(struct damage_region* dmg, int x, int y, int width, int height) {
+    add(dmg, x, y, width, height);
+}
+
+// the part of r inside view goes to in, up to four strips around it to out
+static void split(struct damage_region* in, struct damage_region* out, const XRectangle* view
+                  , const XRectangle* r) {
+    int x1 = MAX(r->x, view->x);
+    int y1 = MAX(r->y, view->y);
+    int x2 = MIN(r->x + r->width, view->x + view->width);
+    int y2 = MIN(r->y + r->height, view->y + view->height);
+    if (x1 >= x2 || y1 >= y2) {
+        add(out, r->x, r->y, r->width, r->height);
+        return;
+    }
+    add(in, x1, y1, x2 - x1, y2 - y1);
+    add(out, r->x, r->y, r->width, y1 - r->y);
+    add(out, r->x, y2, r->width, r->y + r->height - y2);
+    add(out, r->x, y1, x1 - r->x, y2 - y1);
+    add(out, x2, y1, r->x + r->width - x2, y2 - y1);
+}
+
+void damage_add_split(struct damage_region* in, struct damage_region* out, const XRectangle* view
+                      , int x, int y, int width, int height) {
+    XRectangle r = {x, y, width, height};
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    metric_add(MetricDamageRects, 1);
+    split(in, out, view, &r);
+}
+
+// sort out the rects of from again, after view moved; from may be out
+void damage_move(struct damage_region* from, struct damage_region* in, struct damage_region* out
+                 , const XRectangle* view) {
+    XRectangle rects[DAMAGE_MAX_RECTS];
+    int cnt = from->cnt;
+    memcpy(rects, from->rects, cnt * sizeof(XRectangle));
+    damage_clear(from);
+    for (int i = 0; i < cnt; i += 1) {
+        split(in, out, view, &rects[i]);
+    }
+}
+
+// squared distance from x, y to the nearest pixel of r
+static long distance(const XRectangle* r, int x, int y) {
+    long dx = x < r->x ? r->x - x : MAX(0, x - (r->x + r->width - 1));
+    long dy = y < r->y ? r->y - y : MAX(0, y - (r->y + r->height - 1));
+    return dx * dx + dy * dy;
+}
+
+// rects nearest to x, y first, they're captured in this order
+void damage_sort(struct damage_region* dmg, int x, int y) {
+    for (int i = 1; i < dmg->cnt; i += 1) {
+        XRectangle r = dmg->rects[i];
+        long d = distance(&r, x, y);
+        int j = i;
+        while (j > 0 && distance(&dmg->rects[j - 1], x, y) > d) {
+            dmg->rects[j] = dmg->rects[j - 1];
+            j -= 1;
+        }
+        dmg->rects[j] = r;
+    }
+}
+
+bool damage_empty(const struct damage_region* dmg) {
+    return 0 == dmg->cnt;
+}
+
+void damage_clear(struct damage_region* dmg) {
+    dmg->cnt = 0;
+}
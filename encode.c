@@ -0,0 +1,388 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <X11/Xlibint.h>
+#include <webp/encode.h>
+#if WITH_LZ4
+#include <lz4.h>
+#endif
+
+#include "x-viredero.h"
+
+#define DELTA_ZSTD_LEVEL 1
+
+// Encoders turn a rect of framebuffer pixels (X server pixel format, as
+// described by the capture XImage) into the negotiated screen format.
+// They run on the encoder threads and never talk to the X server.
+
+// XImage describing framebuffer pixels, for XGetPixel on odd visuals
+static XImage framebuffer_view(struct context* ctx, char* src, int stride
+                               , int width, int height) {
+    XImage view = *ctx->p.bmp.shmimage;
+    view.data = src;
+    view.bytes_per_line = stride;
+    view.width = width;
+    view.height = height;
+    return view;
+}
+
+// every codec's output goes through here once
+static int counted(enum ImageCodec codec, int width, int height, int len) {
+    if (len > 0) {
+        metric_add(MetricCodecRects + codec, 1);
+        metric_add(MetricCodecRaw + codec, width * height * 3);
+        metric_add(MetricCodecBytes + codec, len);
+    }
+    return len;
+}
+
+static int get_image_bmp(struct context* ctx, struct encoder* enc, char* out, int out_size
+                         , char* src, int stride, int width, int height) {
+    XImage view = framebuffer_view(ctx, src, stride, width, height);
+    if (out_size < width * height * 3) {
+        return 0;
+    }
+    convert_ximage_rgb(&view, ctx->p.bmp.to_rgb, RgbWire, out, width, height);
+    return counted(CodecRgb, width, height, width * height * 3);
+}
+
+static int get_image_png(struct context* ctx, struct encoder* enc, char* out, int out_size
+                         , char* src, int stride, int width, int height) {
+    pixel_row_fn row = ctx->p.bmp.to_png;
+    if (NULL == row) {
+        // no fast path for this visual, go through XGetPixel first
+        XImage view = framebuffer_view(ctx, src, stride, width, height);
+        if (!reserve_buffer(&enc->rgb, &enc->rgb_size, width * height * 3)) {
+            return 0;
+        }
+        convert_ximage_rgb(&view, NULL, RgbTrue, enc->rgb, width, height);
+        src = enc->rgb;
+        stride = width * 3;
+        row = rgb_row_copy;
+    }
+    return counted(CodecPng, width, height
+                   , png_encode(&enc->png, ctx->cfg.png_level, ctx->cfg.png_filter, out, out_size
+                                , src, stride, width, height, row, 3));
+}
+
+// Most of an XORed rect is zero, a fast byte compressor gets it down to
+// a fraction of the RGB at about the speed of a copy and the client only
+// has to decompress and XOR.
+static int get_image_delta(struct context* ctx, struct encoder* enc, char* out, int out_size
+                           , char* src, int stride, int width, int height) {
+    XImage view = framebuffer_view(ctx, src, stride, width, height);
+    int raw = width * height * 3;
+    long len = 0;
+    if (out_size < 1 || !reserve_buffer(&enc->rgb, &enc->rgb_size, raw)) {
+        return 0;
+    }
+    // XOR goes through the byte shuffle unharmed
+    convert_ximage_rgb(&view, ctx->p.bmp.to_rgb, RgbWire, enc->rgb, width, height);
+    out[0] = ctx->cfg.delta | (enc->replace ? 0 : DELTA_XOR);
+    switch (ctx->cfg.delta) {
+#if WITH_LZ4
+    case DeltaLz4:
+        len = LZ4_compress_default(enc->rgb, out + 1, raw, out_size - 1);
+        break;
+#endif
+#if WITH_ZSTD
+    case DeltaZstd:
+        if (NULL == enc->zstd && NULL == (enc->zstd = ZSTD_createCCtx())) {
+            return 0;
+        }
+        len = ZSTD_compressCCtx(enc->zstd, out + 1, out_size - 1, enc->rgb, raw
+                                , DELTA_ZSTD_LEVEL);
+        if (ZSTD_isError(len)) {
+            len = 0;
+        }
+        break;
+#endif
+    }
+    return counted(CodecDelta, width, height, len > 0 ? len + 1 : 0);
+}
+
+// BGRX bytes of the rect, copied only for visuals that aren't native XRGB
+static char* bgrx_pixels(struct context* ctx, struct encoder* enc, char* src, int* stride
+                         , int width, int height) {
+    XImage view;
+    if (ctx->p.bmp.argb_native) {
+        return src;
+    }
+    view = framebuffer_view(ctx, src, *stride, width, height);
+    if (!reserve_buffer(&enc->argb, &enc->argb_size, width * height * 4)) {
+        return NULL;
+    }
+    convert_ximage_argb(&view, false, (uint32_t*)enc->argb, width, height);
+    *stride = width * 4;
+    return enc->argb;
+}
+
+// Raw and smaller than RGB, for clients that convert on the GPU and
+// links where compression is what the CPU can't keep up with
+static int get_image_yuv420(struct context* ctx, struct encoder* enc, char* out, int out_size
+                            , char* src, int stride, int width, int height) {
+    int len = width * height + (width + 1) / 2 * ((height + 1) / 2) * 2;
+    if (out_size < len || NULL == (src = bgrx_pixels(ctx, enc, src, &stride, width, height))) {
+        return 0;
+    }
+    convert_yuv420(src, stride, out, width, height);
+    return counted(CodecYuv420, width, height, len);
+}
+
+static int get_image_rgb565(struct context* ctx, struct encoder* enc, char* out, int out_size
+                            , char* src, int stride, int width, int height) {
+    int len = width * height * 2;
+    if (out_size < len || NULL == (src = bgrx_pixels(ctx, enc, src, &stride, width, height))) {
+        return 0;
+    }
+    convert_rgb565(src, stride, out, width, height, enc->x, enc->y
+                   , DitherBayer == ctx->cfg.dither);
+    return counted(CodecRgb565, width, height, len);
+}
+
+// bounded WebPMemoryWrite: the output is a slice of the job buffer and
+// must not be realloc'ed
+struct webp_writer {
+    char* mem;
+    int size;
+    int max_size;
+};
+
+static int write_webp(const uint8_t* data, size_t len, const WebPPicture* pic) {
+    struct webp_writer* w = (struct webp_writer*)pic->custom_ptr;
+    if (len > w->max_size - w->size) {
+        return 0;
+    }
+    memcpy(w->mem + w->size, data, len);
+    w->size += len;
+    return 1;
+}
+
+static int encode_webp(struct context* ctx, struct encoder* enc, WebPConfig* config
+                       , char* out, int out_size, char* src, int stride, int width, int height) {
+    WebPPicture* pic = &enc->picture;
+    XImage view = framebuffer_view(ctx, src, stride, width, height);
+    struct webp_writer w;
+    if (!enc->picture_ready) {
+        if (!WebPPictureInit(pic)) {
+            return 0;
+        }
+        pic->use_argb = 1;
+        pic->writer = write_webp;
+        enc->picture_ready = true;
+    }
+    // X leaves the alpha byte of depth 24 pixels zero, WebP would take
+    // that as fully transparent
+    if (!reserve_buffer(&enc->argb, &enc->argb_size, width * height * 4)) {
+        return 0;
+    }
+    convert_ximage_argb(&view, ctx->p.bmp.argb_native, (uint32_t*)enc->argb, width, height);
+    pic->width = width;
+    pic->height = height;
+    pic->argb = (uint32_t*)enc->argb;
+    pic->argb_stride = width;
+    w.mem = out;
+    w.max_size = out_size;
+    w.size = 0;
+    pic->custom_ptr = &w;
+    if (!WebPEncode(config, pic)) {
+        slog(LOG_WARNING, "WebP: encoding %dx%d failed: %d", width, height, pic->error_code);
+        return 0;
+    }
+    return counted(config->lossless ? CodecWebpLossless : CodecWebpLossy, width, height, w.size);
+}
+
+static int get_image_webp(struct context* ctx, struct encoder* enc, char* out, int out_size
+                          , char* src, int stride, int width, int height) {
+    WebPConfig* config = enc->coarse ? &ctx->p.webp.coarse : &ctx->p.webp.config;
+    return encode_webp(ctx, enc, config, out, out_size, src, stride, width, height);
+}
+
+static bool webp_config(WebPConfig* config, bool lossless, int quality, int method) {
+    if (!WebPConfigPreset(config, WEBP_PRESET_DEFAULT, quality)) {
+        return false;
+    }
+    // for lossless quality is the effort spent, not fidelity
+    config->lossless = lossless;
+    config->method = method;
+    if (!WebPValidateConfig(config)) {
+        slog(LOG_ERR, "WebP: bad encoder config");
+        return false;
+    }
+    return true;
+}
+
+// what to use instead when the client can't decode the preferred codec
+static const enum ImageCodec codec_fallbacks[][3] = {
+    [CodecRgb] = {CodecRgb, CodecPng, CodecWebpLossless},
+    [CodecPng] = {CodecPng, CodecWebpLossless, CodecRgb},
+    [CodecWebpLossless] = {CodecWebpLossless, CodecPng, CodecRgb},
+    [CodecWebpLossy] = {CodecWebpLossy, CodecPng, CodecRgb},
+};
+
+static const int codec_formats[] = {
+    [CodecRgb] = SF_RGB,
+    [CodecPng] = SF_PNG,
+    [CodecWebpLossless] = SF_WEBP,
+    [CodecWebpLossy] = SF_WEBP,
+    [CodecDelta] = SF_DELTA,
+    [CodecYuv420] = SF_YUV420,
+    [CodecRgb565] = SF_RGB565,
+};
+
+static int get_image_mixed(struct context* ctx, struct encoder* enc, char* out, int out_size
+                           , char* src, int stride, int width, int height) {
+    XImage view = framebuffer_view(ctx, src, stride, width, height);
+    // coarse rects are refined later, whatever they show
+    enum ImageCodec want = enc->coarse ? CodecWebpLossy
+        : classify_rect(&view, ctx->p.bmp.argb_native);
+    enum ImageCodec codec = want;
+    int len = 0;
+    for (int i = 0; i < 3; i += 1) {
+        codec = codec_fallbacks[want][i];
+        if ((ctx->p.webp.formats & codec_formats[codec]) != 0) {
+            break;
+        }
+    }
+    if (out_size < 1) {
+        return 0;
+    }
+    out[0] = codec;
+    out += 1;
+    out_size -= 1;
+    switch (codec) {
+    case CodecRgb:
+        len = get_image_bmp(ctx, enc, out, out_size, src, stride, width, height);
+        break;
+    case CodecPng:
+        len = get_image_png(ctx, enc, out, out_size, src, stride, width, height);
+        break;
+    case CodecWebpLossless:
+        len = encode_webp(ctx, enc, &ctx->p.webp.lossless, out, out_size
+                          , src, stride, width, height);
+        break;
+    case CodecWebpLossy:
+        len = encode_webp(ctx, enc, enc->coarse ? &ctx->p.webp.coarse : &ctx->p.webp.config
+                          , out, out_size, src, stride, width, height);
+        break;
+    default: // every client can take raw pixels
+        out[-1] = CodecRgb;
+        len = get_image_bmp(ctx, enc, out, out_size, src, stride, width, height);
+        break;
+    }
+    return len > 0 ? len + 1 : 0;
+}
+
+// pixel layout of the capture, shmimage is the template for every rect
+void encoder_visual(struct context* ctx, XImage* shmimage) {
+    ctx->p.bmp.shmimage = shmimage;
+    ctx->p.bmp.to_rgb = select_rgb_converter(shmimage, RgbWire);
+    ctx->p.bmp.to_png = select_rgb_converter(shmimage, RgbTrue);
+    ctx->p.bmp.argb_native = is_native_argb(shmimage);
+}
+
+// smallest encoding of those offered, 0 if there's none we can do
+int encoder_format(int formats) {
+    int codecs = formats & (SF_RGB | SF_PNG | SF_WEBP);
+    if ((formats & SF_MIXED) != 0 && codecs != 0) {
+        return SF_MIXED | codecs;
+    }
+#if WITH_LZ4 || WITH_ZSTD
+    // a client asking for it is on a link where latency beats size
+    if ((formats & SF_DELTA) != 0) {
+        return SF_DELTA;
+    }
+#endif
+    if ((formats & SF_WEBP) != 0) {
+        return SF_WEBP;
+    }
+    if ((formats & SF_PNG) != 0) {
+        return SF_PNG;
+    }
+    // raw ones last, smallest first
+    if ((formats & SF_YUV420) != 0) {
+        return SF_YUV420;
+    }
+    if ((formats & SF_RGB565) != 0) {
+        return SF_RGB565;
+    }
+    return formats & SF_RGB;
+}
+
+// format is what encoder_format picked
+bool init_encoder(struct context* ctx, int format) {
+    struct config* cfg = &ctx->cfg;
+    if ((format & SF_MIXED) != 0) {
+        if (!webp_config(&ctx->p.webp.config, false, cfg->webp_quality, cfg->webp_method)
+            || !webp_config(&ctx->p.webp.lossless, true, cfg->webp_quality, cfg->webp_method)
+            || !webp_config(&ctx->p.webp.coarse, false, cfg->background_quality
+                            , cfg->webp_method)) {
+            return false;
+        }
+        ctx->p.webp.formats = format & ~SF_MIXED;
+        ctx->encode_image = get_image_mixed;
+    } else if (SF_WEBP == format) {
+        if (!webp_config(&ctx->p.webp.config, cfg->webp_lossless, cfg->webp_quality
+                         , cfg->webp_method)
+            || !webp_config(&ctx->p.webp.coarse, false, cfg->background_quality
+                            , cfg->webp_method)) {
+            return false;
+        }
+        ctx->encode_image = get_image_webp;
+        slog(LOG_INFO, "WebP: %s, quality %d, method %d"
+             , cfg->webp_lossless ? "lossless" : "lossy", cfg->webp_quality, cfg->webp_method);
+    } else if (SF_PNG == format) {
+        ctx->encode_image = get_image_png;
+    } else if (SF_RGB == format) {
+        ctx->encode_image = get_image_bmp;
+    } else if (SF_YUV420 == format) {
+        ctx->encode_image = get_image_yuv420;
+    } else if (SF_RGB565 == format) {
+        ctx->encode_image = get_image_rgb565;
+        slog(LOG_INFO, "RGB565, %s dither", ctx->cfg.dither ? "ordered" : "no");
+    } else if (SF_DELTA == format) {
+#if !WITH_LZ4
+        if (DeltaLz4 == cfg->delta) {
+            slog(LOG_ERR, "Built without LZ4");
+            return false;
+        }
+#endif
+#if !WITH_ZSTD
+        if (DeltaZstd == cfg->delta) {
+            slog(LOG_ERR, "Built without zstd");
+            return false;
+        }
+#endif
+        if (!fb_keep_previous(&ctx->fb)) {
+            return false;
+        }
+        ctx->encode_image = get_image_delta;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,244 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/param.h>
+
+#include "x-viredero.h"
+
+// The retained framebuffer is what the client is showing: pixels of every
+// tile we've sent, in the X server's own pixel format. Damage is captured,
+// compared with it tile by tile and only tiles that really changed are
+// copied in and handed to the encoder.
+
+void fb_free(struct framebuffer* fb) {
+    free(fb->pixels);
+    free(fb->valid);
+    free(fb->forced);
+    free(fb->prev);
+    free(fb->changed);
+    fb->pixels = NULL;
+    fb->valid = NULL;
+    fb->forced = NULL;
+    fb->prev = NULL;
+    fb->changed = NULL;
+}
+
+bool fb_init(struct framebuffer* fb, int width, int height, int bpp) {
+    fb_free(fb);
+    fb->width = width;
+    fb->height = height;
+    fb->bpp = bpp;
+    fb->stride = width * bpp;
+    fb->tiles_x = (width + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+    fb->tiles_y = (height + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+    fb->pixels = malloc((size_t)fb->stride * height);
+    fb->valid = calloc(fb->tiles_x * fb->tiles_y, 1);
+    fb->forced = calloc(fb->tiles_x * fb->tiles_y, 1);
+    fb->changed = malloc(sizeof(XRectangle) * fb->tiles_x * fb->tiles_y);
+    fb->damaged_bytes = 0;
+    fb->dropped_bytes = 0;
+    if (NULL == fb->pixels || NULL == fb->valid || NULL == fb->forced || NULL == fb->changed) {
+        slog(LOG_ERR, "Cannot allocate %dx%d framebuffer", width, height);
+        fb_free(fb);
+        return false;
+    }
+    return true;
+}
+
+void fb_invalidate(struct framebuffer* fb) {
+    memset(fb->valid, 0, fb->tiles_x * fb->tiles_y);
+}
+
+// client has something else under the rect, e.g. a lossy picture
+void fb_invalidate_rect(struct framebuffer* fb, int x, int y, int width, int height) {
+    for (int ty = y / FB_TILE_SIZE; ty <= (y + height - 1) / FB_TILE_SIZE; ty += 1) {
+        memset(fb->valid + ty * fb->tiles_x + x / FB_TILE_SIZE, 0
+               , (x + width - 1) / FB_TILE_SIZE - x / FB_TILE_SIZE + 1);
+    }
+}
+
+char* fb_pixels(struct framebuffer* fb, int x, int y) {
+    return fb->pixels + (long)y * fb->stride + x * fb->bpp;
+}
+
+// delta codecs need the pixels a change replaced, until fb_init
+bool fb_keep_previous(struct framebuffer* fb) {
+    if (NULL == fb->prev) {
+        fb->prev = malloc((size_t)fb->stride * fb->height);
+    }
+    return fb->prev != NULL;
+}
+
+// some tile under the rect was forced by the last fb_update
+bool fb_forced(const struct framebuffer* fb, int x, int y, int width, int height) {
+    for (int ty = y / FB_TILE_SIZE; ty <= (y + height - 1) / FB_TILE_SIZE; ty += 1) {
+        for (int tx = x / FB_TILE_SIZE; tx <= (x + width - 1) / FB_TILE_SIZE; tx += 1) {
+            if (fb->forced[ty * fb->tiles_x + tx]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// client has every tile under the rect exactly as we do
+bool fb_valid(const struct framebuffer* fb, int x, int y, int width, int height) {
+    for (int ty = y / FB_TILE_SIZE; ty <= (y + height - 1) / FB_TILE_SIZE; ty += 1) {
+        for (int tx = x / FB_TILE_SIZE; tx <= (x + width - 1) / FB_TILE_SIZE; tx += 1) {
+            if (!fb->valid[ty * fb->tiles_x + tx]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Grow r (root window pixels) to whole scale x scale blocks, cut to the
+// part of the root the fb covers and turn it into fb pixels; false if
+// nothing is left. The root edge that doesn't fill a block never shows.
+bool fb_scale_rect(const struct framebuffer* fb, int scale, XRectangle* r) {
+    int x1 = MAX(0, r->x) / scale;
+    int y1 = MAX(0, r->y) / scale;
+    int x2 = MIN((r->x + r->width + scale - 1) / scale, fb->width);
+    int y2 = MIN((r->y + r->height + scale - 1) / scale, fb->height);
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+    r->x = x1;
+    r->y = y1;
+    r->width = x2 - x1;
+    r->height = y2 - y1;
+    return true;
+}
+
+// what a CopyRect does on the client, source and destination may overlap
+void fb_copy(struct framebuffer* fb, int x, int y, int width, int height, int src_x, int src_y) {
+    int len = width * fb->bpp;
+    if (src_y >= y) {
+        for (int j = 0; j < height; j += 1) {
+            memmove(fb_pixels(fb, x, y + j), fb_pixels(fb, src_x, src_y + j), len);
+        }
+    } else {
+        for (int j = height - 1; j >= 0; j -= 1) {
+            memmove(fb_pixels(fb, x, y + j), fb_pixels(fb, src_x, src_y + j), len);
+        }
+    }
+}
+
+// compare and, if anything differs, take over the src rows of one tile
+static bool update_tile(struct framebuffer* fb, const char* src, int src_stride
+                        , int x, int y, int width, int height, bool force) {
+    char* dst = fb_pixels(fb, x, y);
+    int len = width * fb->bpp;
+    int j = 0;
+    if (!force) {
+        while (j < height && 0 == memcmp(dst, src, len)) {
+            dst += fb->stride;
+            src += src_stride;
+            j += 1;
+        }
+        if (j == height) {
+            return false;
+        }
+    }
+    if (fb->prev != NULL) {
+        // rows above j are the same, but the whole tile goes out
+        char* d = fb_pixels(fb, x, y);
+        char* p = fb->prev + (d - fb->pixels);
+        for (int k = 0; k < height; k += 1) {
+            memcpy(p + (long)k * fb->stride, d + (long)k * fb->stride, len);
+        }
+    }
+    for (; j < height; j += 1) {
+        memcpy(dst, src, len);
+        dst += fb->stride;
+        src += src_stride;
+    }
+    return true;
+}
+
+// extend a run of the rows above if it spans the same columns
+static bool merge_down(XRectangle* prev, int prev_cnt, XRectangle* run) {
+    for (int i = 0; i < prev_cnt; i += 1) {
+        if (prev[i].x == run->x && prev[i].width == run->width
+            && prev[i].y + prev[i].height == run->y) {
+            prev[i].height += run->height;
+            return true;
+        }
+    }
+    return false;
+}
+
+// rect x, y, width, height is in src with src_stride, already clipped to fb
+int fb_update(struct framebuffer* fb, const char* src, int src_stride
+              , int x, int y, int width, int height) {
+    int tx1 = x / FB_TILE_SIZE;
+    int tx2 = (x + width - 1) / FB_TILE_SIZE;
+    int ty1 = y / FB_TILE_SIZE;
+    int ty2 = (y + height - 1) / FB_TILE_SIZE;
+    int cnt = 0;
+    for (int ty = ty1; ty <= ty2; ty += 1) {
+        int y1 = MAX(y, ty * FB_TILE_SIZE);
+        int y2 = MIN(y + height, (ty + 1) * FB_TILE_SIZE);
+        int row_start = cnt;
+        XRectangle run = {0, 0, 0, 0};
+        for (int tx = tx1; tx <= tx2; tx += 1) {
+            int x1 = MAX(x, tx * FB_TILE_SIZE);
+            int x2 = MIN(x + width, (tx + 1) * FB_TILE_SIZE);
+            char* valid = &fb->valid[ty * fb->tiles_x + tx];
+            const char* s = src + (long)(y1 - y) * src_stride + (x1 - x) * fb->bpp;
+            fb->forced[ty * fb->tiles_x + tx] = !*valid;
+            bool changed = update_tile(fb, s, src_stride, x1, y1, x2 - x1, y2 - y1, !*valid);
+            if (x2 - x1 == MIN(FB_TILE_SIZE, fb->width - tx * FB_TILE_SIZE)
+                && y2 - y1 == MIN(FB_TILE_SIZE, fb->height - ty * FB_TILE_SIZE)) {
+                *valid = 1;
+            }
+            fb->damaged_bytes += (x2 - x1) * (y2 - y1) * fb->bpp;
+            metric_add(MetricCapturedBytes, (x2 - x1) * (y2 - y1) * fb->bpp);
+            if (!changed) {
+                fb->dropped_bytes += (x2 - x1) * (y2 - y1) * fb->bpp;
+                metric_add(MetricUnchangedBytes, (x2 - x1) * (y2 - y1) * fb->bpp);
+                continue;
+            }
+            if (run.width > 0 && run.x + run.width == x1) {
+                run.width += x2 - x1;
+                continue;
+            }
+            if (run.width > 0 && !merge_down(fb->changed, row_start, &run)) {
+                fb->changed[cnt++] = run;
+            }
+            run.x = x1;
+            run.y = y1;
+            run.width = x2 - x1;
+            run.height = y2 - y1;
+        }
+        if (run.width > 0 && !merge_down(fb->changed, row_start, &run)) {
+            fb->changed[cnt++] = run;
+        }
+    }
+    return cnt;
+}
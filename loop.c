@@ -0,0 +1,209 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+#include "x-viredero.h"
+
+// The pump sleeps in epoll_wait() on the X connection, the encoders'
+// eventfd, two timerfds (next pointer update, next frame), a signalfd for
+// shutdown and trace dumps and whatever fds the transport asks for.
+// Every fd is tagged with the LoopEvent bit it raises.
+
+#define LOOP_MAX_EVENTS 16
+
+static bool watch(struct event_loop* loop, int fd, uint32_t events, enum LoopEvent tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        slog(LOG_ERR, "epoll: cannot watch fd %d: %m", fd);
+        return false;
+    }
+    return true;
+}
+
+static void set_timer(int fd, unsigned long first_msec, unsigned long interval_msec, int flags) {
+    struct itimerspec its;
+    its.it_value.tv_sec = first_msec / 1000;
+    its.it_value.tv_nsec = first_msec % 1000 * 1000000;
+    its.it_interval.tv_sec = interval_msec / 1000;
+    its.it_interval.tv_nsec = interval_msec % 1000 * 1000000;
+    timerfd_settime(fd, flags, &its, NULL);
+}
+
+static void loop_sigset(sigset_t* sigs) {
+    sigemptyset(sigs);
+    sigaddset(sigs, SIGINT);
+    sigaddset(sigs, SIGTERM);
+    sigaddset(sigs, SIGUSR1);
+}
+
+// Signals go through the loop's signalfd. Threads inherit the mask, so
+// this has to run before anything (libusb, encoders, stats) starts one.
+void loop_block_signals() {
+    sigset_t sigs;
+    loop_sigset(&sigs);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+}
+
+bool loop_init(struct event_loop* loop, int x_fd) {
+    sigset_t sigs;
+    loop_sigset(&sigs);
+    loop->transport_cnt = 0;
+    loop->frame_deadline = 0;
+    loop->pointer_deadline = 0;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->pointer_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->frame_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->epfd < 0 || loop->pointer_timer < 0 || loop->frame_timer < 0
+        || loop->signal_fd < 0) {
+        slog(LOG_ERR, "Cannot set up event loop: %m");
+        return false;
+    }
+    return watch(loop, x_fd, EPOLLIN, LoopX)
+        && watch(loop, loop->pointer_timer, EPOLLIN, LoopPointer)
+        && watch(loop, loop->frame_timer, EPOLLIN, LoopFrame)
+        && watch(loop, loop->signal_fd, EPOLLIN, LoopSignal);
+}
+
+bool loop_watch_done(struct event_loop* loop, int done_fd) {
+    return watch(loop, done_fd, EPOLLIN, LoopDone);
+}
+
+// deadline in now() msec, 0 disarms
+static void set_deadline(int fd, unsigned long* armed, unsigned long deadline) {
+    if (deadline == *armed) {
+        return;
+    }
+    *armed = deadline;
+    if (0 == deadline) {
+        set_timer(fd, 0, 0, 0);
+        return;
+    }
+    // now() is CLOCK_MONOTONIC too, a deadline in the past fires at once
+    set_timer(fd, deadline, 0, TFD_TIMER_ABSTIME);
+}
+
+void loop_set_frame(struct event_loop* loop, unsigned long deadline) {
+    set_deadline(loop->frame_timer, &loop->frame_deadline, deadline);
+}
+
+void loop_set_pointer(struct event_loop* loop, unsigned long deadline) {
+    set_deadline(loop->pointer_timer, &loop->pointer_deadline, deadline);
+}
+
+static uint32_t to_epoll(short events) {
+    return (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+}
+
+// Transport fds come and go (clients, libusb), so they are re-synced
+// before every wait. A closed fd leaves epoll by itself and its number
+// may be reused right away, hence MOD first and ADD when that fails.
+static void sync_transport(struct context* ctx, struct event_loop* loop) {
+    struct pollfd fds[LOOP_MAX_TRANSPORT_FDS];
+    int cnt = ctx->poll_fds ? ctx->poll_fds(ctx, fds, LOOP_MAX_TRANSPORT_FDS) : 0;
+    for (int i = 0; i < loop->transport_cnt; i += 1) {
+        bool keep = false;
+        for (int j = 0; j < cnt && !keep; j += 1) {
+            keep = fds[j].fd == loop->transport[i].fd;
+        }
+        if (!keep) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->transport[i].fd, NULL);
+        }
+    }
+    for (int j = 0; j < cnt; j += 1) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = to_epoll(fds[j].events);
+        ev.data.u32 = LoopTransport;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fds[j].fd, &ev) < 0
+            && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fds[j].fd, &ev) < 0) {
+            slog(LOG_WARNING, "epoll: cannot watch transport fd %d: %m", fds[j].fd);
+        }
+        loop->transport[j] = fds[j];
+    }
+    loop->transport_cnt = cnt;
+}
+
+// block until something happens, returns LoopEvent bits
+unsigned loop_wait(struct context* ctx, struct event_loop* loop) {
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    unsigned fired = 0;
+    int timeout = -1;
+    int cnt;
+    sync_transport(ctx, loop);
+    // Xlib may hold events it already read, the fd won't tell about those
+    if (XEventsQueued(ctx->display, QueuedAlready) > 0) {
+        timeout = 0;
+        fired |= LoopX;
+    }
+    XFlush(ctx->display);
+    cnt = epoll_wait(loop->epfd, evs, LOOP_MAX_EVENTS, timeout);
+    if (cnt < 0 && errno != EINTR) {
+        slog(LOG_ERR, "epoll_wait failed: %m");
+    }
+    for (int i = 0; i < cnt; i += 1) {
+        fired |= evs[i].data.u32;
+    }
+    if (fired & LoopPointer) {
+        uint64_t junk;
+        read(loop->pointer_timer, &junk, sizeof(junk));
+        loop->pointer_deadline = 0;
+    }
+    if (fired & LoopFrame) {
+        uint64_t junk;
+        read(loop->frame_timer, &junk, sizeof(junk));
+        loop->frame_deadline = 0;
+    }
+    if (fired & LoopDone) {
+        eventfd_t junk;
+        eventfd_read(ctx->pl.done_fd, &junk);
+    }
+    if (fired & LoopSignal) {
+        struct signalfd_siginfo si;
+        fired &= ~LoopSignal;
+        while (read(loop->signal_fd, &si, sizeof(si)) == sizeof(si)) {
+            if (SIGUSR1 == si.ssi_signo) {
+                fired |= LoopDump;
+            } else {
+                slog(LOG_NOTICE, "got signal %d, shutting down", si.ssi_signo);
+                fired |= LoopSignal;
+            }
+        }
+    }
+    return fired;
+}
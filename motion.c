@@ -0,0 +1,220 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/param.h>
+
+#include "x-viredero.h"
+
+// Scrolls in SF_PRIMITIVES sessions. Every row of the damaged rect is
+// hashed, as captured and as the client has it in the framebuffer. Rows
+// that occur only once in the old picture vote for how far they moved;
+// the longest run of rows that moved by the winning distance goes out as
+// one CopyRect and is moved in the framebuffer as well, so fb_update only
+// finds the strip that scrolled in. Columns get the same treatment when
+// the rows didn't move.
+
+#define MOTION_MIN_SIZE 64 // damage narrower or lower than this goes out as it is
+#define MOTION_MIN_LINES 16 // rows (columns) that have to move together
+#define MOTION_MIN_VOTES 4
+#define MOTION_COLUMN_STEP 8 // column hashes sample every 8th row
+
+struct lines {
+    uint64_t* cur; // hash per line, as captured
+    uint64_t* old; // as the client has it
+    int* slots; // old line + 1 by hash, negative for lines that repeat
+    int* votes; // by distance + n
+    int nslots;
+    int n;
+};
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+    h = (h ^ v) * 1099511628211ULL;
+    return h ^ (h >> 32);
+}
+
+// four lanes, one multiply chain would be the bottleneck
+static void hash_rows(uint64_t* out, const char* p, int stride, int len, int height) {
+    for (int j = 0; j < height; j += 1) {
+        uint64_t h[4] = {14695981039346656037ULL, 1, 2, 3};
+        int i = 0;
+        for (; i + 32 <= len; i += 32) {
+            uint64_t v[4];
+            memcpy(v, p + i, 32);
+            for (int k = 0; k < 4; k += 1) {
+                h[k] = mix(h[k], v[k]);
+            }
+        }
+        for (; i < len; i += 1) {
+            h[0] = mix(h[0], (uint8_t)p[i]);
+        }
+        out[j] = mix(mix(mix(h[0], h[1]), h[2]), h[3]);
+        p += stride;
+    }
+}
+
+static void hash_columns(uint64_t* out, const char* p, int stride, int width, int height
+                         , int bpp) {
+    for (int i = 0; i < width; i += 1) {
+        out[i] = 14695981039346656037ULL;
+    }
+    for (int j = 0; j < height; j += MOTION_COLUMN_STEP) {
+        const char* row = p + (long)j * stride;
+        for (int i = 0; i < width; i += 1) {
+            uint32_t v = 0;
+            if (4 == bpp) {
+                memcpy(&v, row + i * 4, 4);
+            } else {
+                memcpy(&v, row + i * bpp, bpp);
+            }
+            out[i] = mix(out[i], v);
+        }
+    }
+}
+
+static bool lines_init(struct context* ctx, struct lines* l, int n) {
+    l->n = n;
+    l->nslots = 1;
+    while (l->nslots < 2 * n) {
+        l->nslots *= 2;
+    }
+    if (!reserve_buffer(&ctx->motion_buf, &ctx->motion_buf_size
+                        , 2 * n * sizeof(uint64_t) + (l->nslots + 2 * n) * sizeof(int))) {
+        return false;
+    }
+    l->cur = (uint64_t*)ctx->motion_buf;
+    l->old = l->cur + n;
+    l->slots = (int*)(l->old + n);
+    l->votes = l->slots + l->nslots;
+    return true;
+}
+
+// Distance d the most lines moved by, cur[j] == old[j + d]. Lines [start,
+// start + len) are the longest run that moved that far and isn't where it
+// was anyway. False if nothing worth a CopyRect moved.
+static bool find_shift(struct lines* l, int* d, int* start, int* len) {
+    int n = l->n;
+    int best = 0;
+    int moved = 0;
+    memset(l->slots, 0, l->nslots * sizeof(int));
+    memset(l->votes, 0, 2 * n * sizeof(int));
+    for (int i = 0; i < n; i += 1) {
+        int k = l->old[i] & (l->nslots - 1);
+        while (l->slots[k] != 0 && l->old[abs(l->slots[k]) - 1] != l->old[i]) {
+            k = (k + 1) & (l->nslots - 1);
+        }
+        l->slots[k] = 0 == l->slots[k] ? i + 1 : -abs(l->slots[k]);
+    }
+    for (int j = 0; j < n; j += 1) {
+        int k = l->cur[j] & (l->nslots - 1);
+        while (l->slots[k] != 0 && l->old[abs(l->slots[k]) - 1] != l->cur[j]) {
+            k = (k + 1) & (l->nslots - 1);
+        }
+        if (l->slots[k] > 0 && l->slots[k] - 1 != j) {
+            l->votes[l->slots[k] - 1 - j + n] += 1;
+        }
+    }
+    for (int i = 1; i < 2 * n; i += 1) {
+        if (l->votes[i] > l->votes[best]) {
+            best = i;
+        }
+    }
+    if (l->votes[best] < MOTION_MIN_VOTES) {
+        return false;
+    }
+    *d = best - n;
+    *len = 0;
+    for (int j = MAX(0, -*d), run = 0, run_moved = 0; j <= MIN(n, n - *d); j += 1) {
+        if (j < MIN(n, n - *d) && l->cur[j] == l->old[j + *d]) {
+            run += 1;
+            run_moved += l->cur[j] != l->old[j];
+            continue;
+        }
+        if (run_moved > moved) {
+            moved = run_moved;
+            *start = j - run;
+            *len = run;
+        }
+        run = 0;
+        run_moved = 0;
+    }
+    return moved >= MOTION_MIN_LINES;
+}
+
+// hashes only found the candidate
+static bool same(const char* a, int a_stride, const char* b, int b_stride, int len, int rows) {
+    for (int j = 0; j < rows; j += 1) {
+        if (memcmp(a + (long)j * a_stride, b + (long)j * b_stride, len) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool copy(struct context* ctx, int x, int y, int width, int height, int src_x, int src_y) {
+    struct primitive_msg pm = {CopyRect, x, y, width, height, src_x, src_y, 0};
+    slog(LOG_DEBUG, "copy %dx%d from %d,%d to %d,%d", width, height, src_x, src_y, x, y);
+    fb_copy(&ctx->fb, x, y, width, height, src_x, src_y);
+    return pipeline_submit_primitive(ctx, &pm);
+}
+
+// Rect x, y, width, height has just been captured into src, call before
+// fb_update does the rest.
+bool motion_copy(struct context* ctx, const char* src, int src_stride
+                 , int x, int y, int width, int height) {
+    struct framebuffer* fb = &ctx->fb;
+    const char* old = fb_pixels(fb, x, y);
+    int bpp = fb->bpp;
+    struct lines l;
+    int d;
+    int start;
+    int len;
+    if (0 == (ctx->screen_format & SF_PRIMITIVES) || width < MOTION_MIN_SIZE
+        || height < MOTION_MIN_SIZE || !fb_valid(fb, x, y, width, height)) {
+        return true;
+    }
+    if (!lines_init(ctx, &l, height)) {
+        return false;
+    }
+    hash_rows(l.cur, src, src_stride, width * bpp, height);
+    hash_rows(l.old, old, fb->stride, width * bpp, height);
+    if (find_shift(&l, &d, &start, &len)) {
+        return !same(src + (long)start * src_stride, src_stride
+                     , old + (long)(start + d) * fb->stride, fb->stride, width * bpp, len)
+            || copy(ctx, x, y + start, width, len, x, y + start + d);
+    }
+    if (!lines_init(ctx, &l, width)) {
+        return false;
+    }
+    hash_columns(l.cur, src, src_stride, width, height, bpp);
+    hash_columns(l.old, old, fb->stride, width, height, bpp);
+    if (find_shift(&l, &d, &start, &len)) {
+        return !same(src + start * bpp, src_stride, old + (start + d) * bpp, fb->stride
+                     , len * bpp, height)
+            || copy(ctx, x + start, y, len, height, x + start + d, y);
+    }
+    return true;
+}
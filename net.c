@@ -17,46 +17,379 @@
  * License along with viredero; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <syslog.h>
 
+#include <sys/uio.h>
+#include <sys/param.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "x-viredero.h"
 
-static bool sock_img_writer(struct context* ctx, int x, int y, int width, int height
-                            , char* data, int data_len) {
-    int size = width * height * 3;
-    int fd = ctx->w.sctx.sock;
-    if (0 == fd) {
-        fd = accept(ctx->w.sctx.listen_sock, NULL, NULL);
-        if (fd < 0) {
-            slog(LOG_ERR, "Failed to accept connection: %m");
-            exit(1);
-        }
-        ctx->w.sctx.sock = fd;
-    }
-    char* header = fill_imagecmd_header(data, data_len, width, height, x, y);
-    size += 17;
-    while (size > 0) {
-        int sent = send(fd, header, size, 0);
-        if (sent <= 0) {
+// Every viewer has its own queue of messages, written with sendmsg()
+// from a non-blocking socket, as many at once as fit into one iovec
+// array. A message is a private header plus a payload that is copied once
+// and shared, by reference count, between all the queues it's on. A slow
+// viewer only grows its own queue (and is dropped when that gets too
+// long); backpressure follows the fastest one.
+
+#define SOCK_MAX_IOV 64
+
+struct msgbuf {
+    int refs;
+    int len;
+    char data[];
+};
+
+struct out_msg {
+    struct out_msg* next;
+    int hlen;
+    int off; // bytes of head + payload already sent
+    char head[MAX(MAX(IMAGECMD_HEAD_LEN, POINTERCMD_HEAD_LEN)
+                  , MAX(PRIMCMD_HEAD_LEN, MAX_INIT_BUF_SIZE))];
+    struct msgbuf* payload; // NULL for header only messages
+};
+
+static int payload_len(const struct out_msg* m) {
+    return m->payload ? m->payload->len : 0;
+}
+
+static void msgbuf_put(struct msgbuf* mb) {
+    if (mb != NULL && 0 == --mb->refs) {
+        free(mb);
+    }
+}
+
+static void client_close(struct sock_client* cl) {
+    struct out_msg* m = cl->out_head;
+    while (m != NULL) {
+        struct out_msg* next = m->next;
+        msgbuf_put(m->payload);
+        free(m);
+        m = next;
+    }
+    cl->out_head = NULL;
+    cl->out_tail = NULL;
+    cl->queued = 0;
+    cl->rlen = 0;
+    cl->ready = false;
+    if (cl->sock >= 0) {
+        close(cl->sock);
+        cl->sock = -1;
+    }
+}
+
+static bool client_flush(struct sock_client* cl) {
+    while (cl->out_head != NULL) {
+        struct iovec iov[SOCK_MAX_IOV];
+        struct msghdr mh;
+        struct out_msg* m;
+        int cnt = 0;
+        ssize_t sent;
+        for (m = cl->out_head; m != NULL && cnt + 2 <= SOCK_MAX_IOV; m = m->next) {
+            if (m->off < m->hlen) {
+                iov[cnt].iov_base = m->head + m->off;
+                iov[cnt].iov_len = m->hlen - m->off;
+                cnt += 1;
+            }
+            if (payload_len(m) > 0) {
+                int poff = MAX(0, m->off - m->hlen);
+                iov[cnt].iov_base = m->payload->data + poff;
+                iov[cnt].iov_len = m->payload->len - poff;
+                cnt += 1;
+            }
+        }
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+        sent = sendmsg(cl->sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno) {
+                return true;
+            }
             slog(LOG_WARNING, "send failed: %m");
-            close(fd);
-            fd = 0;
+            client_close(cl);
+            return false;
+        }
+        cl->queued -= sent;
+        while (sent > 0) {
+            m = cl->out_head;
+            int left = m->hlen + payload_len(m) - m->off;
+            if (sent < left) {
+                m->off += sent;
+                break;
+            }
+            sent -= left;
+            cl->out_head = m->next;
+            msgbuf_put(m->payload);
+            free(m);
+        }
+        if (NULL == cl->out_head) {
+            cl->out_tail = NULL;
+        }
+    }
+    return true;
+}
+
+static bool client_enqueue(struct context* ctx, struct sock_client* cl, const char* head
+                           , int hlen, struct msgbuf* payload) {
+    struct out_msg* m;
+    long len = hlen + (payload ? payload->len : 0);
+    if (hlen > (int)sizeof(m->head)) {
+        slog(LOG_ERR, "%d byte header does not fit an out_msg", hlen);
+        return false;
+    }
+    if (cl->queued + len > (long)ctx->cfg.sock_queue_kb * 1024) {
+        slog(LOG_WARNING, "client is %ld bytes behind, dropping it", cl->queued);
+        metric_add(MetricDroppedViewers, 1);
+        client_close(cl);
+        return false;
+    }
+    m = malloc(sizeof(struct out_msg));
+    if (NULL == m) {
+        return false;
+    }
+    m->next = NULL;
+    m->hlen = hlen;
+    m->off = 0;
+    memcpy(m->head, head, hlen);
+    m->payload = payload;
+    if (payload != NULL) {
+        payload->refs += 1;
+    }
+    if (cl->out_tail != NULL) {
+        cl->out_tail->next = m;
+    } else {
+        cl->out_head = m;
+    }
+    cl->out_tail = m;
+    cl->queued += len;
+    return client_flush(cl);
+}
+
+// same message to every viewer past its handshake, payload copied once
+static bool sock_broadcast(struct context* ctx, const char* head, int hlen
+                           , const char* data, int dlen) {
+    struct sock_context* sctx = &ctx->w.sctx;
+    struct msgbuf* payload = NULL;
+    bool res = true;
+    if (dlen > 0) {
+        payload = malloc(sizeof(struct msgbuf) + dlen);
+        if (NULL == payload) {
             return false;
         }
-        size -= sent;
-        header += sent;
+        payload->refs = 1; // ours, until every queue has it
+        payload->len = dlen;
+        memcpy(payload->data, data, dlen);
+    }
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &sctx->clients[i];
+        if (cl->sock >= 0 && cl->ready) {
+            res = client_enqueue(ctx, cl, head, hlen, payload) && res;
+        }
+    }
+    // nobody watching is fine, the next viewer gets a full frame anyway
+    msgbuf_put(payload);
+    return res;
+}
+
+static bool sock_img_writer(struct context* ctx, int x, int y, int width, int height
+                            , char* data, int data_len) {
+    char head[IMAGECMD_HEAD_LEN];
+    fill_imagecmd_header(head, data_len, width, height, x, y);
+    return sock_broadcast(ctx, head, IMAGECMD_HEAD_LEN, data, data_len);
+}
+
+static bool sock_pntr_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    char head[POINTERCMD_HEAD_LEN];
+    int hlen = fill_pointercmd_header(head, pm);
+    return sock_broadcast(ctx, head, hlen, data, pm->len);
+}
+
+static bool sock_prim_writer(struct context* ctx, const struct primitive_msg* pm) {
+    char head[PRIMCMD_HEAD_LEN];
+    int hlen = fill_primcmd_header(head, pm);
+    return sock_broadcast(ctx, head, hlen, NULL, 0);
+}
+
+// InitReply goes to whoever sent the Init, a successful one lets it in
+static bool sock_send_reply(struct context* ctx, char* buf, int size) {
+    struct sock_client* cl = &ctx->w.sctx.clients[ctx->w.sctx.cmd_from];
+    if (cl->sock < 0 || size > MAX_INIT_BUF_SIZE) {
+        return false;
+    }
+    if (!client_enqueue(ctx, cl, buf, size, NULL)) {
+        return false;
     }
+    cl->ready = InitReply == buf[0] && ResultSuccess == buf[1];
     return true;
 }
 
+static bool sock_flush(struct context* ctx) {
+    bool res = true;
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &ctx->w.sctx.clients[i];
+        if (cl->sock >= 0) {
+            res = client_flush(cl) && res;
+        }
+    }
+    return res;
+}
+
+static void client_setup(struct context* ctx, struct sock_client* cl, int fd) {
+    int sndbuf = ctx->cfg.sock_sndbuf_kb * 1024;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) < 0) {
+        slog(LOG_WARNING, "TCP_NODELAY failed: %m");
+    }
+    if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) < 0) {
+        slog(LOG_WARNING, "SO_SNDBUF failed: %m");
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    cl->sock = fd;
+    cl->rlen = 0;
+    cl->ready = false;
+    cl->since = now();
+}
+
+// take a free slot, or the oldest viewer's once sock-clients are connected
+static void sock_accept(struct context* ctx) {
+    struct sock_context* sctx = &ctx->w.sctx;
+    struct sock_client* free_slot = NULL;
+    struct sock_client* oldest = NULL;
+    int used = 0;
+    int fd = accept(sctx->listen_sock, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &sctx->clients[i];
+        if (cl->sock < 0) {
+            free_slot = free_slot ? free_slot : cl;
+        } else {
+            used += 1;
+            oldest = oldest && oldest->since <= cl->since ? oldest : cl;
+        }
+    }
+    if (used >= ctx->cfg.sock_clients || NULL == free_slot) {
+        slog(LOG_NOTICE, "new client replaces the oldest one");
+        client_close(oldest);
+        free_slot = oldest;
+    } else {
+        slog(LOG_NOTICE, "new client connected, %d viewers", used + 1);
+    }
+    client_setup(ctx, free_slot, fd);
+}
+
+static int client_read_cmd(struct sock_client* cl, char* buf, int size) {
+    int len = recv_command(cl->sock, cl->rbuf, &cl->rlen, buf, size);
+    if (len < 0) {
+        slog(LOG_NOTICE, "client disconnected");
+        client_close(cl);
+        return 0;
+    }
+    return len;
+}
+
+static int sock_read_command(struct context* ctx, char* buf, int size) {
+    struct sock_context* sctx = &ctx->w.sctx;
+    sock_accept(ctx);
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &sctx->clients[i];
+        int len;
+        if (cl->sock < 0) {
+            continue;
+        }
+        len = client_read_cmd(cl, buf, size);
+        if (len > 0) {
+            sctx->cmd_from = i;
+            return len;
+        }
+    }
+    return 0;
+}
+
+// wait for the first viewer's Init
+static bool sock_init_conn(struct context* ctx, char* buf, int size) {
+    struct sock_context* sctx = &ctx->w.sctx;
+    for (;;) {
+        struct pollfd fds[SOCK_MAX_CLIENTS + 1];
+        int cnt = 0;
+        int len = sock_read_command(ctx, buf, MAX_COMMAND_LEN);
+        if (len > 0 && Init == buf[0]) {
+            return true;
+        }
+        if (len > 0) {
+            continue;
+        }
+        fds[cnt].fd = sctx->listen_sock;
+        fds[cnt].events = POLLIN;
+        cnt += 1;
+        for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+            if (sctx->clients[i].sock >= 0) {
+                fds[cnt].fd = sctx->clients[i].sock;
+                fds[cnt].events = POLLIN;
+                cnt += 1;
+            }
+        }
+        if (poll(fds, cnt, -1) < 0) {
+            slog(LOG_ERR, "Waiting for a client failed: %m");
+            return false;
+        }
+    }
+}
+
+// backpressure follows the fastest viewer, slow ones fall behind alone
+static long sock_queued(struct context* ctx) {
+    long queued = -1;
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &ctx->w.sctx.clients[i];
+        if (cl->sock >= 0 && cl->ready && (queued < 0 || cl->queued < queued)) {
+            queued = cl->queued;
+        }
+    }
+    return MAX(queued, 0);
+}
+
+static int sock_peers(struct context* ctx) {
+    int peers = 0;
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        struct sock_client* cl = &ctx->w.sctx.clients[i];
+        peers += cl->sock >= 0 && cl->ready && i != ctx->w.sctx.cmd_from;
+    }
+    return peers;
+}
+
+static int sock_poll_fds(struct context* ctx, struct pollfd* fds, int max) {
+    struct sock_context* sctx = &ctx->w.sctx;
+    int cnt = 0;
+    if (max < 1) {
+        return 0;
+    }
+    fds[cnt].fd = sctx->listen_sock;
+    fds[cnt].events = POLLIN;
+    cnt += 1;
+    for (int i = 0; i < SOCK_MAX_CLIENTS && cnt < max; i += 1) {
+        struct sock_client* cl = &sctx->clients[i];
+        if (cl->sock >= 0) {
+            fds[cnt].fd = cl->sock;
+            fds[cnt].events = POLLIN | (cl->out_head != NULL ? POLLOUT : 0);
+            cnt += 1;
+        }
+    }
+    return cnt;
+}
+
 void init_socket(struct context* ctx, uint16_t port) {
     struct sock_context* sctx = &ctx->w.sctx;
     struct sockaddr_in addr;
@@ -80,9 +413,22 @@ void init_socket(struct context* ctx, uint16_t port) {
         slog(LOG_ERR, "Socket listen failed: %m");
         exit(1);
     }
+    // read_command looks for new clients on every pump iteration
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
     sctx->listen_sock = sock;
-    sctx->sock = 0;
+    sctx->cmd_from = 0;
+    for (int i = 0; i < SOCK_MAX_CLIENTS; i += 1) {
+        memset(&sctx->clients[i], 0, sizeof(struct sock_client));
+        sctx->clients[i].sock = -1;
+    }
     ctx->write_image = sock_img_writer;
-    ctx->write_pointer = dummy_pointer_writer;
+    ctx->write_pointer = sock_pntr_writer;
+    ctx->write_primitive = sock_prim_writer;
+    ctx->init_conn = sock_init_conn;
+    ctx->read_command = sock_read_command;
+    ctx->send_reply = sock_send_reply;
+    ctx->flush_out = sock_flush;
+    ctx->poll_fds = sock_poll_fds;
+    ctx->out_queued = sock_queued;
+    ctx->out_peers = sock_peers;
 }
-
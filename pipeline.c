@@ -0,0 +1,410 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <sys/param.h>
+#include <sys/eventfd.h>
+
+#include "x-viredero.h"
+
+// Capture -> encode -> send.
+//
+// The capturing thread (the one owning the X connection) copies changed
+// pixels out of the framebuffer into a job from a fixed ring and puts the
+// job on a lock-free queue. Encoder workers take jobs from that queue in
+// any order and mark them done. The capturing thread then hands jobs to
+// the writer strictly in ring order, so the wire sees messages in the
+// order they were captured no matter which worker finished first. Pointer
+// and primitive messages take a slot in the same ring and skip the encoders.
+
+#define PIPELINE_BAND_PIXELS (256 * 1024) // split bigger rects between workers
+
+enum JobState {
+    JobFree,
+    JobQueued,
+    JobDone,
+};
+
+// Bounded MPMC queue, see D. Vyukov's "Bounded MPMC queue". The ring never
+// holds more than PIPELINE_DEPTH jobs, so pushing can't fail.
+static void queue_init(struct job_queue* q) {
+    for (unsigned long i = 0; i < PIPELINE_DEPTH; i += 1) {
+        q->cells[i].seq = i;
+    }
+    q->enq = 0;
+    q->deq = 0;
+    sem_init(&q->items, 0, 0);
+}
+
+static void queue_push(struct job_queue* q, struct job* job) {
+    unsigned long pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    for (;;) {
+        struct job_cell* cell = &q->cells[pos % PIPELINE_DEPTH];
+        long dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+        if (0 == dif) {
+            if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, true
+                                            , __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->job = job;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        } else {
+            pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+        }
+    }
+    sem_post(&q->items);
+}
+
+static struct job* queue_pop(struct job_queue* q) {
+    unsigned long pos;
+    while (sem_wait(&q->items) != 0) {
+    }
+    pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    for (;;) {
+        struct job_cell* cell = &q->cells[pos % PIPELINE_DEPTH];
+        long dif = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+        if (0 == dif) {
+            if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, true
+                                            , __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                struct job* job = cell->job;
+                __atomic_store_n(&cell->seq, pos + PIPELINE_DEPTH, __ATOMIC_RELEASE);
+                return job;
+            }
+        } else {
+            pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+bool reserve_buffer(char** buf, int* size, int need) {
+    if (*size >= need) {
+        return true;
+    }
+    char* b = realloc(*buf, need);
+    if (NULL == b) {
+        slog(LOG_ERR, "Cannot allocate %d bytes for pipeline", need);
+        return false;
+    }
+    *buf = b;
+    *size = need;
+    return true;
+}
+
+static void xor_row(char* dst, const char* a, const char* b, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        memcpy(dst + i, &x, 8);
+    }
+    for (; i < len; i += 1) {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+static void encode_job(struct context* ctx, struct worker* w, struct job* job) {
+    job->encoder = w - ctx->pl.workers;
+    w->enc.replace = job->replace;
+    w->enc.coarse = job->coarse;
+    w->enc.x = job->x;
+    w->enc.y = job->y;
+    job->stamp[TpEncodeStart] = now_usec();
+    job->len = ctx->encode_image(ctx, &w->enc, job->buf + DATA_BUFFER_HEAD
+                                 , job->buf_size - DATA_BUFFER_HEAD, job->pixels
+                                 , job->stride, job->width, job->height);
+    job->stamp[TpEncoded] = now_usec();
+    __atomic_store_n(&job->state, JobDone, __ATOMIC_RELEASE);
+}
+
+static void* encoder_thread(void* arg) {
+    struct worker* w = (struct worker*)arg;
+    struct pipeline* pl = w->pl;
+    struct job* job;
+    stats_thread();
+    while ((job = queue_pop(&pl->queue)) != NULL) {
+        encode_job(pl->ctx, w, job);
+        eventfd_write(pl->done_fd, 1);
+    }
+    return NULL;
+}
+
+bool pipeline_init(struct context* ctx, int workers) {
+    struct pipeline* pl = &ctx->pl;
+    pl->ctx = ctx;
+    pl->head = 0;
+    pl->tail = 0;
+    pl->discard = false;
+    pl->nworkers = workers;
+    queue_init(&pl->queue);
+    pl->done_fd = eventfd(0, EFD_CLOEXEC);
+    if (pl->done_fd < 0) {
+        slog(LOG_ERR, "Cannot create pipeline eventfd: %m");
+        return false;
+    }
+    pl->workers = calloc(workers + 1, sizeof(struct worker)); // +1 for inline encoding
+    for (int i = 0; i < workers; i += 1) {
+        pl->workers[i].pl = pl;
+        if (pthread_create(&pl->workers[i].thread, NULL, encoder_thread, &pl->workers[i]) != 0) {
+            slog(LOG_ERR, "Cannot start encoder thread: %m");
+            pl->nworkers = i;
+            break;
+        }
+    }
+    slog(LOG_INFO, "%d encoder threads", pl->nworkers);
+    return true;
+}
+
+static bool send_job(struct context* ctx, struct job* job) {
+    char* data = job->buf + DATA_BUFFER_HEAD;
+    struct pointer_msg pm = {job->kind, job->x, job->y, job->width, job->height, job->slot
+                             , job->len};
+    bool res;
+    if (JobPointer == job->type) {
+        res = ctx->write_pointer(ctx, &pm, data);
+    } else if (JobPrimitive == job->type) {
+        res = ctx->write_primitive(ctx, &job->prim);
+    } else {
+        res = job->len > 0
+            && ctx->write_image(ctx, job->x, job->y, job->width, job->height, data, job->len);
+    }
+    if (!res) {
+        metric_add(MetricSendFailures, 1);
+    } else if (JobPointer == job->type) {
+        metric_add(MetricSentPointers, 1);
+        metric_add(MetricSentBytes, pointercmd_len(&pm));
+    } else if (JobPrimitive == job->type) {
+        metric_add(CopyRect == job->prim.type ? MetricSentCopies : MetricSentFills, 1);
+        metric_add(MetricSentBytes, primcmd_len(&job->prim));
+    } else {
+        metric_add(MetricSentImages, 1);
+        metric_add(MetricSentBytes, IMAGECMD_HEAD_LEN + job->len);
+    }
+    return res;
+}
+
+// ordered sender: hand every finished job at the head of the ring to the writer
+void pipeline_send_ready(struct context* ctx) {
+    struct pipeline* pl = &ctx->pl;
+    while (pl->head != pl->tail) {
+        struct job* job = &pl->ring[pl->head % PIPELINE_DEPTH];
+        if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JobDone) {
+            break;
+        }
+        if (!pl->discard) {
+            update_fail_cnt(ctx, send_job(ctx, job));
+            trace_sent(&ctx->trace, job);
+        } else {
+            metric_add(MetricDiscarded, 1);
+        }
+        job->state = JobFree;
+        pl->head += 1;
+    }
+}
+
+// block until the oldest job is encoded and sent
+static void send_head(struct context* ctx) {
+    struct pipeline* pl = &ctx->pl;
+    unsigned long head = pl->head;
+    pipeline_send_ready(ctx);
+    while (head == pl->head) {
+        eventfd_t cnt;
+        eventfd_read(pl->done_fd, &cnt);
+        pipeline_send_ready(ctx);
+    }
+}
+
+void pipeline_drain(struct context* ctx) {
+    while (ctx->pl.head != ctx->pl.tail) {
+        send_head(ctx);
+    }
+}
+
+// send what's left and let the encoder threads go
+void pipeline_stop(struct context* ctx) {
+    struct pipeline* pl = &ctx->pl;
+    pipeline_drain(ctx);
+    for (int i = 0; i < pl->nworkers; i += 1) {
+        queue_push(&pl->queue, NULL);
+    }
+    for (int i = 0; i < pl->nworkers; i += 1) {
+        pthread_join(pl->workers[i].thread, NULL);
+    }
+    pl->nworkers = 0;
+}
+
+// wait for jobs in flight but don't send them, the client starts over
+void pipeline_discard(struct context* ctx) {
+    ctx->pl.discard = true;
+    pipeline_drain(ctx);
+    ctx->pl.discard = false;
+}
+
+static struct job* next_job(struct context* ctx) {
+    struct pipeline* pl = &ctx->pl;
+    if (pl->tail - pl->head == PIPELINE_DEPTH) {
+        send_head(ctx);
+    }
+    return &pl->ring[pl->tail % PIPELINE_DEPTH];
+}
+
+static void submit(struct context* ctx, struct job* job) {
+    struct pipeline* pl = &ctx->pl;
+    pl->tail += 1;
+    job->stamp[TpQueued] = now_usec();
+    if (job->type != JobImage) {
+        job->stamp[TpEvent] = job->stamp[TpQueued];
+        job->stamp[TpCapture] = job->stamp[TpQueued];
+        job->stamp[TpEncodeStart] = job->stamp[TpQueued];
+        job->stamp[TpEncoded] = job->stamp[TpQueued];
+        job->encoder = 0;
+        job->state = JobDone;
+    } else if (0 == pl->nworkers) {
+        encode_job(ctx, &pl->workers[0], job);
+    } else {
+        job->state = JobQueued;
+        queue_push(&pl->queue, job);
+    }
+}
+
+static bool submit_band(struct context* ctx, int x, int y, int width, int height) {
+    struct framebuffer* fb = &ctx->fb;
+    struct job* job = next_job(ctx);
+    int stride = width * fb->bpp;
+    // same worst case the output buffer was always sized for
+    if (!reserve_buffer(&job->pixels, &job->pixels_size, stride * height)
+        || !reserve_buffer(&job->buf, &job->buf_size, DATA_BUFFER_HEAD + width * height * 4 + 1024)) {
+        return false;
+    }
+    char* src = fb_pixels(fb, x, y);
+    // SF_DELTA: what the client has is what fb_update just replaced,
+    // unless the client never had those tiles
+    job->replace = NULL == fb->prev || fb_forced(fb, x, y, width, height);
+    if (job->replace) {
+        for (int j = 0; j < height; j += 1) {
+            memcpy(job->pixels + j * stride, src, stride);
+            src += fb->stride;
+        }
+    } else {
+        char* old = fb->prev + (src - fb->pixels);
+        for (int j = 0; j < height; j += 1) {
+            xor_row(job->pixels + j * stride, src, old, stride);
+            src += fb->stride;
+            old += fb->stride;
+        }
+    }
+    job->type = JobImage;
+    job->coarse = ctx->pl.coarse;
+    job->stamp[TpEvent] = ctx->pl.t_event;
+    job->stamp[TpCapture] = ctx->pl.t_capture;
+    job->x = x;
+    job->y = y;
+    job->width = width;
+    job->height = height;
+    job->stride = stride;
+    submit(ctx, job);
+    return true;
+}
+
+// damage about to be captured goes back to event_usec, coarse if it's
+// outside the viewport and may go out at background_quality
+void pipeline_begin_capture(struct context* ctx, unsigned long event_usec, bool coarse) {
+    ctx->pl.coarse = coarse;
+    ctx->pl.t_capture = now_usec();
+    ctx->pl.t_event = MIN(event_usec, ctx->pl.t_capture);
+}
+
+// every row the same as the first, which is all one pixel
+static bool solid(struct framebuffer* fb, int x, int y, int width, int height) {
+    const char* first = fb_pixels(fb, x, y);
+    for (int i = 1; i < width; i += 1) {
+        if (memcmp(first + i * fb->bpp, first, fb->bpp) != 0) {
+            return false;
+        }
+    }
+    for (int j = 1; j < height; j += 1) {
+        if (memcmp(fb_pixels(fb, x, y + j), first, width * fb->bpp) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// queue a framebuffer rect for encoding, big rects go out as several bands
+bool pipeline_submit_image(struct context* ctx, int x, int y, int width, int height) {
+    int band = MAX(FB_TILE_SIZE, PIPELINE_BAND_PIXELS / width / FB_TILE_SIZE * FB_TILE_SIZE);
+    if ((ctx->screen_format & SF_PRIMITIVES) && solid(&ctx->fb, x, y, width, height)) {
+        struct primitive_msg pm = {FillRect, x, y, width, height, 0, 0
+                                   , pixel_rgb(ctx->p.bmp.shmimage, fb_pixels(&ctx->fb, x, y))};
+        return pipeline_submit_primitive(ctx, &pm);
+    }
+    for (int j = 0; j < height; j += band) {
+        if (!submit_band(ctx, x, y + j, width, MIN(band, height - j))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// pm->len bytes of data are the payload
+bool pipeline_submit_pointer(struct context* ctx, const struct pointer_msg* pm
+                             , const char* data) {
+    struct job* job = next_job(ctx);
+    if (!reserve_buffer(&job->buf, &job->buf_size, DATA_BUFFER_HEAD + pm->len)) {
+        return false;
+    }
+    if (pm->len > 0) {
+        memcpy(job->buf + DATA_BUFFER_HEAD, data, pm->len);
+    }
+    job->type = JobPointer;
+    job->kind = pm->kind;
+    job->x = pm->x;
+    job->y = pm->y;
+    job->width = pm->width;
+    job->height = pm->height;
+    job->slot = pm->slot;
+    job->len = pm->len;
+    submit(ctx, job);
+    return true;
+}
+
+bool pipeline_submit_primitive(struct context* ctx, const struct primitive_msg* pm) {
+    struct job* job = next_job(ctx);
+    job->type = JobPrimitive;
+    job->prim = *pm;
+    job->x = pm->x;
+    job->y = pm->y;
+    job->width = pm->width;
+    job->height = pm->height;
+    job->len = 0;
+    submit(ctx, job);
+    return true;
+}
@@ -0,0 +1,243 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "x-viredero.h"
+
+// Minimal PNG writer: 8 bit RGB or RGBA, one IDAT deflated straight into
+// the output buffer. The z_stream lives as long as the encoder thread and
+// is only reset between images.
+
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_RGBA 6
+#define PNG_CHUNK_OVERHEAD 12 // length, type, crc
+
+static const unsigned char png_signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+static bool png_init(struct png_encoder* png, int level) {
+    png->zs.zalloc = Z_NULL;
+    png->zs.zfree = Z_NULL;
+    png->zs.opaque = Z_NULL;
+    // screen content has long runs, RLE matching is much cheaper at low levels
+    if (deflateInit2(&png->zs, level, Z_DEFLATED, 15, 8
+                     , level <= 3 ? Z_RLE : Z_DEFAULT_STRATEGY) != Z_OK) {
+        slog(LOG_ERR, "PNG: deflateInit failed");
+        return false;
+    }
+    png->level = level;
+    png->ready = true;
+    return true;
+}
+
+static bool reserve_rows(struct png_encoder* png, int row_len) {
+    if (png->row_len >= row_len) {
+        return true;
+    }
+    // current and previous raw row, plus one filtered row per filter type
+    char* rows = realloc(png->rows, (row_len + 1) * (2 + PngFilterPaeth + 1));
+    if (NULL == rows) {
+        return false;
+    }
+    png->rows = rows;
+    png->row_len = row_len;
+    return true;
+}
+
+static uint8_t paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+static void filter_row(int type, const uint8_t* cur, const uint8_t* prev, uint8_t* out
+                       , int len, int bpp) {
+    int i;
+    out[0] = type;
+    out += 1;
+    switch (type) {
+    case PngFilterNone:
+        memcpy(out, cur, len);
+        break;
+    case PngFilterSub:
+        memcpy(out, cur, bpp);
+        for (i = bpp; i < len; i += 1) {
+            out[i] = cur[i] - cur[i - bpp];
+        }
+        break;
+    case PngFilterUp:
+        for (i = 0; i < len; i += 1) {
+            out[i] = cur[i] - prev[i];
+        }
+        break;
+    case PngFilterAvg:
+        for (i = 0; i < bpp; i += 1) {
+            out[i] = cur[i] - (prev[i] >> 1);
+        }
+        for (; i < len; i += 1) {
+            out[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+        }
+        break;
+    case PngFilterPaeth:
+        for (i = 0; i < bpp; i += 1) {
+            out[i] = cur[i] - prev[i];
+        }
+        for (; i < len; i += 1) {
+            out[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+        }
+        break;
+    }
+}
+
+// the usual heuristic: smallest sum of absolute (signed) residuals
+static unsigned long row_cost(const uint8_t* row, int len) {
+    unsigned long sum = 0;
+    for (int i = 1; i <= len; i += 1) {
+        sum += abs((int8_t)row[i]);
+    }
+    return sum;
+}
+
+static const uint8_t* choose_filter(struct png_encoder* png, int filter, const uint8_t* cur
+                                    , const uint8_t* prev, int len, int bpp) {
+    uint8_t* out = (uint8_t*)png->rows + 2 * (png->row_len + 1);
+    const uint8_t* best;
+    unsigned long best_cost;
+    if (filter != PngFilterAdaptive) {
+        filter_row(filter, cur, prev, out, len, bpp);
+        return out;
+    }
+    best = out;
+    filter_row(PngFilterNone, cur, prev, out, len, bpp);
+    best_cost = row_cost(out, len);
+    for (int t = PngFilterSub; t <= PngFilterPaeth; t += 1) {
+        uint8_t* o = out + t * (png->row_len + 1);
+        unsigned long cost;
+        filter_row(t, cur, prev, o, len, bpp);
+        cost = row_cost(o, len);
+        if (cost < best_cost) {
+            best = o;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+static char* put_chunk_head(char* out, int len, const char* type) {
+    *(uint32_t*)out = htonl(len);
+    memcpy(out + 4, type, 4);
+    return out + 8;
+}
+
+// crc covers chunk type and data
+static char* put_chunk_crc(char* chunk_head, int len) {
+    uLong crc = crc32(0, (const Bytef*)chunk_head + 4, len + 4);
+    char* end = chunk_head + 8 + len;
+    *(uint32_t*)end = htonl(crc);
+    return end + 4;
+}
+
+// src rows are turned into png pixel rows (bpp bytes each) by row_fn
+int png_encode(struct png_encoder* png, int level, int filter, char* out, int out_size
+               , const char* src, int stride, int width, int height
+               , pixel_row_fn row_fn, int bpp) {
+    int len = width * bpp;
+    uint8_t* cur;
+    uint8_t* prev;
+    char* idat;
+    char* p = out;
+    int zres = Z_OK;
+    if (width <= 0 || height <= 0) {
+        return 0;
+    }
+    if ((!png->ready || png->level != level) && !png_encoder_reset(png, level)) {
+        return 0;
+    }
+    if (!reserve_rows(png, len)
+        || out_size < (int)sizeof(png_signature) + 25 + 3 * PNG_CHUNK_OVERHEAD) {
+        return 0;
+    }
+    memcpy(p, png_signature, sizeof(png_signature));
+    p += sizeof(png_signature);
+    p = put_chunk_head(p, 13, "IHDR");
+    ((uint32_t*)p)[0] = htonl(width);
+    ((uint32_t*)p)[1] = htonl(height);
+    p[8] = 8; // bit depth
+    p[9] = 4 == bpp ? PNG_COLOR_RGBA : PNG_COLOR_RGB;
+    p[10] = 0; // deflate
+    p[11] = 0; // adaptive filtering
+    p[12] = 0; // no interlace
+    p = put_chunk_crc(p - 8, 13);
+
+    idat = p;
+    deflateReset(&png->zs);
+    png->zs.next_out = (Bytef*)idat + 8;
+    png->zs.avail_out = out_size - (idat + 8 - out) - PNG_CHUNK_OVERHEAD - 4;
+    cur = (uint8_t*)png->rows;
+    prev = cur + png->row_len + 1;
+    memset(prev, 0, len);
+    for (int j = 0; j < height; j += 1) {
+        const uint8_t* frow;
+        uint8_t* t;
+        row_fn((const uint8_t*)src, cur, width);
+        frow = choose_filter(png, filter, cur, prev, len, bpp);
+        png->zs.next_in = (Bytef*)frow;
+        png->zs.avail_in = len + 1;
+        zres = deflate(&png->zs, j + 1 == height ? Z_FINISH : Z_NO_FLUSH);
+        if (zres == Z_STREAM_ERROR || png->zs.avail_in != 0) {
+            slog(LOG_WARNING, "PNG: %dx%d does not fit into %d bytes", width, height, out_size);
+            return 0;
+        }
+        src += stride;
+        t = prev;
+        prev = cur;
+        cur = t;
+    }
+    if (zres != Z_STREAM_END) {
+        slog(LOG_WARNING, "PNG: %dx%d does not fit into %d bytes", width, height, out_size);
+        return 0;
+    }
+    put_chunk_head(idat, png->zs.total_out, "IDAT");
+    p = put_chunk_crc(idat, png->zs.total_out);
+    p = put_chunk_head(p, 0, "IEND");
+    p = put_chunk_crc(p - 8, 0);
+    return p - out;
+}
+
+bool png_encoder_reset(struct png_encoder* png, int level) {
+    if (png->ready) {
+        deflateEnd(&png->zs);
+        png->ready = false;
+    }
+    return png_init(png, level);
+}
@@ -63,9 +63,8 @@ static bool ppm_img_writer(struct context* ctx, int x, int y, int width, int hei
     ppm_img_writer_with_header(ctx, data, data_len, NULL);
 
 }
-static bool ppm_pntr_writer(struct context* ctx, int x, int y, int width, int height
-                           , char* data) {
-    return ppm_img_writer_with_header(ctx, data, width * height * 4, NULL);
+static bool ppm_pntr_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    return ppm_img_writer_with_header(ctx, data, pm->len, NULL);
 }
 
 static bool ppm_init_conn(struct context* ctx, char* buf, int size) {
@@ -80,8 +79,8 @@ static bool return_true() {
     return true;
 }
 
-static bool return_false() {
-    return false;
+static int no_command() {
+    return 0;
 }
 
 void init_ppm(struct context* ctx, char* path) {
@@ -92,7 +91,7 @@ void init_ppm(struct context* ctx, char* path) {
     ctx->write_image = ppm_img_writer;
     ctx->write_pointer = ppm_pntr_writer;
     ctx->init_conn = ppm_init_conn;
-    ctx->check_reinit = return_false;
+    ctx->read_command = no_command;
     ctx->send_reply = return_true;
 }
 
@@ -0,0 +1,259 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include "x-viredero.h"
+
+// Recording: every message goes into one file as a rec_entry with its
+// payload. Space is preallocated an extent at a time and written through a
+// mapped window, so an ordinary record costs a memcpy and no system call;
+// writeback of a finished window is started, not waited for. The index
+// (offset and time of every record) is kept in memory and appended when
+// the recording is closed.
+
+#define REC_EXTENT (64L * 1024 * 1024)
+#define REC_ALIGN(n) (((n) + 7) & ~7UL)
+
+static unsigned long usec_now(clockid_t clk) {
+    struct timespec tp;
+    clock_gettime(clk, &tp);
+    return tp.tv_sec * 1000000UL + tp.tv_nsec / 1000;
+}
+
+static void unmap_window(struct rec_context* rctx) {
+    if (NULL == rctx->map) {
+        return;
+    }
+    munmap(rctx->map, rctx->map_len);
+    sync_file_range(rctx->fd, rctx->map_off, rctx->map_len, SYNC_FILE_RANGE_WRITE);
+    rctx->map = NULL;
+}
+
+// window starting at the page of pos with room for at least len bytes
+static bool map_window(struct rec_context* rctx, uint64_t len) {
+    uint64_t off = rctx->pos & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    uint64_t map_len = MAX(REC_EXTENT, REC_ALIGN(rctx->pos - off + len));
+    unmap_window(rctx);
+    if (off + map_len > rctx->alloc_end) {
+        int err = posix_fallocate(rctx->fd, rctx->alloc_end, off + map_len - rctx->alloc_end);
+        if (err != 0) {
+            slog(LOG_ERR, "Cannot preallocate recording: %s", strerror(err));
+            return false;
+        }
+        rctx->alloc_end = off + map_len;
+    }
+    rctx->map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, rctx->fd, off);
+    if (MAP_FAILED == rctx->map) {
+        slog(LOG_ERR, "Cannot map recording: %m");
+        rctx->map = NULL;
+        return false;
+    }
+    madvise(rctx->map, map_len, MADV_SEQUENTIAL);
+    rctx->map_off = off;
+    rctx->map_len = map_len;
+    return true;
+}
+
+static bool add_index(struct rec_context* rctx, uint64_t off, uint64_t usec) {
+    if (rctx->index_cnt == rctx->index_size) {
+        uint64_t size = MAX(1024, rctx->index_size * 2);
+        struct rec_index_entry* idx = realloc(rctx->index, size * sizeof(*idx));
+        if (NULL == idx) {
+            slog(LOG_ERR, "Cannot grow recording index");
+            return false;
+        }
+        rctx->index = idx;
+        rctx->index_size = size;
+    }
+    rctx->index[rctx->index_cnt].off = off;
+    rctx->index[rctx->index_cnt].usec = usec;
+    rctx->index_cnt += 1;
+    return true;
+}
+
+static bool rec_append(struct context* ctx, enum RecType type, int x, int y
+                       , int width, int height, int codec, const char* data, int len) {
+    struct rec_context* rctx = &ctx->w.rctx;
+    uint64_t size = REC_ALIGN(sizeof(struct rec_entry) + len);
+    struct rec_entry* e;
+    if (rctx->fd < 0) {
+        return false;
+    }
+    if ((NULL == rctx->map || rctx->pos + size > rctx->map_off + rctx->map_len)
+        && !map_window(rctx, size)) {
+        return false;
+    }
+    e = (struct rec_entry*)(rctx->map + (rctx->pos - rctx->map_off));
+    e->type = type;
+    e->len = len;
+    e->usec = usec_now(CLOCK_MONOTONIC) - rctx->start_usec;
+    e->x = x;
+    e->y = y;
+    e->width = width;
+    e->height = height;
+    e->codec = codec;
+    e->reserved = 0;
+    if (len > 0) {
+        memcpy(e + 1, data, len);
+    }
+    if (!add_index(rctx, rctx->pos, e->usec)) {
+        return false;
+    }
+    rctx->pos += size;
+    return true;
+}
+
+static bool rec_img_writer(struct context* ctx, int x, int y, int width, int height
+                           , char* data, int data_len) {
+    int codec;
+    if (ctx->screen_format & SF_MIXED) {
+        if (data_len < 1) {
+            return false;
+        }
+        codec = data[0];
+        data += 1;
+        data_len -= 1;
+    } else if (ctx->screen_format & SF_WEBP) {
+        codec = ctx->cfg.webp_lossless ? CodecWebpLossless : CodecWebpLossy;
+    } else if (ctx->screen_format & SF_PNG) {
+        codec = CodecPng;
+    } else if (ctx->screen_format & SF_DELTA) {
+        codec = CodecDelta; // payload keeps its DeltaCompression byte
+    } else if (ctx->screen_format & SF_YUV420) {
+        codec = CodecYuv420;
+    } else if (ctx->screen_format & SF_RGB565) {
+        codec = CodecRgb565;
+    } else {
+        codec = CodecRgb;
+    }
+    return rec_append(ctx, RecImage, x, y, width, height, codec, data, data_len);
+}
+
+static bool rec_pntr_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    return rec_append(ctx, RecPointer, pm->x, pm->y, pm->width, pm->height, pm->kind
+                      , data, pm->len);
+}
+
+static bool rec_prim_writer(struct context* ctx, const struct primitive_msg* pm) {
+    if (CopyRect == pm->type) {
+        int32_t src[2] = {pm->src_x, pm->src_y};
+        return rec_append(ctx, RecCopy, pm->x, pm->y, pm->width, pm->height, 0
+                          , (const char*)src, sizeof(src));
+    }
+    return rec_append(ctx, RecFill, pm->x, pm->y, pm->width, pm->height, 0
+                      , (const char*)&pm->color, sizeof(pm->color));
+}
+
+static bool write_head(struct rec_context* rctx) {
+    return pwrite(rctx->fd, &rctx->head, sizeof(rctx->head), 0) == sizeof(rctx->head);
+}
+
+// screen geometry is known once the pump answers our own Init
+static bool rec_send_reply(struct context* ctx, char* buf, int size) {
+    struct rec_context* rctx = &ctx->w.rctx;
+    if (size < 12 || buf[1] != ResultSuccess) {
+        slog(LOG_ERR, "Recording refused, error %d", buf[1]);
+        return false;
+    }
+    rctx->head.screen_format = (uint8_t)buf[2];
+    rctx->head.width = ntohl(((int*)(buf + 4))[0]);
+    rctx->head.height = ntohl(((int*)(buf + 4))[1]);
+    rctx->head.start_usec = usec_now(CLOCK_REALTIME);
+    rctx->start_usec = usec_now(CLOCK_MONOTONIC);
+    return write_head(rctx);
+}
+
+static bool rec_init_conn(struct context* ctx, char* buf, int size) {
+    buf[0] = Init;
+    buf[1] = 1; //VIREDERO protocol version
+    buf[2] = SF_MIXED | SF_RGB | SF_PNG | SF_WEBP | SF_PRIMITIVES;
+    buf[3] = PF_RGBA;
+    return true;
+}
+
+static bool rec_flush(struct context* ctx) {
+    return true;
+}
+
+static int no_command(struct context* ctx, char* buf, int size) {
+    return 0;
+}
+
+// index after the records, head points at it, preallocated tail cut off
+static void rec_close(struct context* ctx) {
+    struct rec_context* rctx = &ctx->w.rctx;
+    uint64_t index_len = rctx->index_cnt * sizeof(struct rec_index_entry);
+    if (rctx->fd < 0) {
+        return;
+    }
+    unmap_window(rctx);
+    rctx->head.data_end = rctx->pos;
+    if (pwrite(rctx->fd, rctx->index, index_len, rctx->pos) == (ssize_t)index_len) {
+        rctx->head.index_off = rctx->pos;
+        rctx->head.index_cnt = rctx->index_cnt;
+    } else {
+        slog(LOG_ERR, "Cannot write recording index: %m");
+    }
+    if (ftruncate(rctx->fd, rctx->pos + (rctx->head.index_off ? index_len : 0)) < 0
+        || !write_head(rctx) || fsync(rctx->fd) < 0) {
+        slog(LOG_ERR, "Cannot finish recording: %m");
+    }
+    slog(LOG_NOTICE, "recorded %lu messages, %lu bytes", (unsigned long)rctx->index_cnt
+         , (unsigned long)rctx->pos);
+    close(rctx->fd);
+    rctx->fd = -1;
+    free(rctx->index);
+    rctx->index = NULL;
+}
+
+void init_rec(struct context* ctx, const char* path) {
+    struct rec_context* rctx = &ctx->w.rctx;
+    memset(rctx, 0, sizeof(*rctx));
+    rctx->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rctx->fd < 0) {
+        slog(LOG_ERR, "Cannot create %s: %m", path);
+        exit(1);
+    }
+    memcpy(rctx->head.magic, REC_MAGIC, sizeof(rctx->head.magic));
+    rctx->head.version = REC_VERSION;
+    rctx->pos = REC_HEAD_SIZE;
+    ctx->write_image = rec_img_writer;
+    ctx->write_pointer = rec_pntr_writer;
+    ctx->write_primitive = rec_prim_writer;
+    ctx->init_conn = rec_init_conn;
+    ctx->read_command = no_command;
+    ctx->send_reply = rec_send_reply;
+    ctx->flush_out = rec_flush;
+    ctx->close_out = rec_close;
+}
@@ -0,0 +1,322 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+
+#include "x-viredero.h"
+
+// Reference reader for the shared memory transport (x-viredero -s). Gets
+// the ring from the socket, asks for a picture and walks the messages in
+// place, printing them (-v) or a summary every second.
+
+struct reader {
+    int sock;
+    int wakefd; // kicked when the server waits for the ring to drain
+    struct shm_ring* ring;
+    const char* data;
+    bool verbose;
+    unsigned long msgs;
+    unsigned long images;
+    unsigned long bytes;
+};
+
+static unsigned long msec_now() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static uint32_t get32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+// the memfd, the wakeup eventfd goes to *wakefd
+static int recv_fds(int sock, int* wakefd) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    int fds[2];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    struct msghdr mh;
+    struct cmsghdr* cm;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    if (recvmsg(sock, &mh, 0) != 1) {
+        return -1;
+    }
+    cm = CMSG_FIRSTHDR(&mh);
+    if (NULL == cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+        || cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    *wakefd = fds[1];
+    return fds[0];
+}
+
+// same layout as the writer: head, then data twice
+static bool ring_map(struct reader* rd, int fd) {
+    struct shm_ring* head = mmap(NULL, SHM_RING_HEAD_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    uint64_t size;
+    char* base;
+    if (MAP_FAILED == head) {
+        return false;
+    }
+    if (head->magic != SHM_RING_MAGIC || head->version != SHM_RING_VERSION) {
+        fprintf(stderr, "Not a viredero ring or a different version\n");
+        return false;
+    }
+    size = head->size;
+    munmap(head, SHM_RING_HEAD_SIZE);
+    base = mmap(NULL, SHM_RING_HEAD_SIZE + 2 * size, PROT_NONE
+                , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base
+        || mmap(base, SHM_RING_HEAD_SIZE + size, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + SHM_RING_HEAD_SIZE + size, size, PROT_READ
+                , MAP_SHARED | MAP_FIXED, fd, SHM_RING_HEAD_SIZE) == MAP_FAILED) {
+        return false;
+    }
+    rd->ring = (struct shm_ring*)base;
+    rd->data = base + SHM_RING_HEAD_SIZE;
+    return true;
+}
+
+// panel is the size the client shows the screen at, 0x0 for the full one
+static bool connect_ring(struct reader* rd, const char* path, int formats
+                         , int panel_w, int panel_h) {
+    struct sockaddr_un addr;
+    char init[INIT_V2_CMD_LEN] = {Init, 2, formats, PF_RGBA | PF_PNG | PF_CACHE};
+    uint32_t panel[2] = {htonl(panel_w), htonl(panel_h)};
+    int fd;
+    memcpy(init + 4, panel, sizeof(panel));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    rd->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (rd->sock < 0 || connect(rd->sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fd = recv_fds(rd->sock, &rd->wakefd);
+    if (fd < 0 || !ring_map(rd, fd)) {
+        fprintf(stderr, "Did not get the ring: %s\n", strerror(errno));
+        return false;
+    }
+    close(fd);
+    return send(rd->sock, init, sizeof(init), MSG_NOSIGNAL) == sizeof(init);
+}
+
+// the writer sees sleeping either before it bumps seq (and wakes us) or
+// after, in which case seq has moved and FUTEX_WAIT returns at once
+static void wait_data(struct reader* rd, uint64_t rpos, int msec) {
+    struct shm_ring* ring = rd->ring;
+    struct timespec ts = {msec / 1000, (msec % 1000) * 1000000L};
+    uint32_t seq;
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE) == rpos) {
+        syscall(SYS_futex, &ring->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+// x,y,w,h with an optional ,gaze x,gaze y
+static bool send_viewport(struct reader* rd, const char* spec) {
+    int v[6] = {0, 0, 0, 0, -1, -1};
+    char cmd[VIEWPORT_CMD_LEN];
+    if (sscanf(spec, "%d,%d,%d,%d,%d,%d", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) < 4) {
+        fprintf(stderr, "Bad viewport %s\n", spec);
+        return false;
+    }
+    cmd[0] = Viewport;
+    for (int i = 0; i < 6; i += 1) {
+        uint32_t n = htonl(v[i]);
+        memcpy(cmd + 1 + 4 * i, &n, sizeof(n));
+    }
+    return send(rd->sock, cmd, sizeof(cmd), 0) == sizeof(cmd);
+}
+
+// server closes the socket when it drops us
+static bool server_gone(struct reader* rd) {
+    struct pollfd pfd = {rd->sock, POLLIN, 0};
+    char c;
+    return poll(&pfd, 1, 0) > 0 && recv(rd->sock, &c, 1, MSG_DONTWAIT) <= 0;
+}
+
+// length of the message at p, -1 to stop
+static long handle_msg(struct reader* rd, const char* p) {
+    long len;
+    switch (p[0]) {
+    case InitReply:
+        if (p[1] != ResultSuccess) {
+            fprintf(stderr, "Init refused, error %d\n", p[1]);
+            return -1;
+        }
+        printf("screen %ux%u, format 0x%x, pointer 0x%x\n", get32(p + 4), get32(p + 8)
+               , (uint8_t)p[2], (uint8_t)p[3]);
+        return 12;
+    case Image:
+        len = IMAGECMD_HEAD_LEN + get32(p + 17);
+        rd->images += 1;
+        if (rd->verbose) {
+            printf("image %ux%u at %u,%u, %u bytes\n", get32(p + 1), get32(p + 5)
+                   , get32(p + 9), get32(p + 13), get32(p + 17));
+        }
+        return len;
+    case Pointer:
+        switch (p[9]) {
+        case PointerMove:
+            return 10;
+        case PointerImage:
+            if (rd->verbose) {
+                printf("pointer %ux%u\n", get32(p + 10), get32(p + 14));
+            }
+            return 18 + 4L * get32(p + 10) * get32(p + 14);
+        case PointerDefine:
+            if (rd->verbose) {
+                printf("pointer %ux%u into slot %u, %u bytes\n", get32(p + 10), get32(p + 14)
+                       , get32(p + 18), get32(p + 22));
+            }
+            return POINTERCMD_HEAD_LEN + get32(p + 22);
+        case PointerCached:
+            if (rd->verbose) {
+                printf("pointer from slot %u\n", get32(p + 10));
+            }
+            return 14;
+        }
+        fprintf(stderr, "Bad pointer message %d\n", p[9]);
+        return -1;
+    case CopyRect:
+        if (rd->verbose) {
+            printf("copy %ux%u from %u,%u to %u,%u\n", get32(p + 9), get32(p + 13)
+                   , get32(p + 17), get32(p + 21), get32(p + 1), get32(p + 5));
+        }
+        return PRIMCMD_HEAD_LEN;
+    case FillRect:
+        if (rd->verbose) {
+            printf("fill %ux%u at %u,%u with %02x%02x%02x\n", get32(p + 9), get32(p + 13)
+                   , get32(p + 1), get32(p + 5), (uint8_t)p[17], (uint8_t)p[18], (uint8_t)p[19]);
+        }
+        return 20;
+    default:
+        fprintf(stderr, "Garbage in the ring: %d\n", p[0]);
+        return -1;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    struct reader rd;
+    int formats = SF_RGB | SF_PNG | SF_WEBP | SF_MIXED | SF_PRIMITIVES;
+    const char* viewport = NULL;
+    int panel_w = 0;
+    int panel_h = 0;
+    unsigned long stats_at = msec_now();
+    uint64_t rpos;
+    int c;
+    memset(&rd, 0, sizeof(rd));
+    while ((c = getopt(argc, argv, "vf:p:V:")) != -1) {
+        switch (c) {
+        case 'v':
+            rd.verbose = true;
+            break;
+        case 'f':
+            formats = strtol(optarg, NULL, 0);
+            break;
+        case 'p':
+            sscanf(optarg, "%dx%d", &panel_w, &panel_h);
+            break;
+        case 'V':
+            viewport = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "USAGE: %s [-v] [-f <ScreenFormat bits>] [-p <panel w>x<h>]"
+                " [-V x,y,w,h[,gaze x,y]]"
+                " <socket path>\n", argv[0]);
+        return 1;
+    }
+    if (!connect_ring(&rd, argv[optind], formats, panel_w, panel_h)
+        || (viewport != NULL && !send_viewport(&rd, viewport))) {
+        return 1;
+    }
+    rpos = __atomic_load_n(&rd.ring->read_pos, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t wpos = __atomic_load_n(&rd.ring->write_pos, __ATOMIC_ACQUIRE);
+        unsigned long t = msec_now();
+        if (t - stats_at >= 1000) {
+            printf("%lu messages, %lu images, %.1f MB/s\n", rd.msgs, rd.images
+                   , rd.bytes / 1000.0 / (t - stats_at));
+            rd.msgs = rd.images = rd.bytes = 0;
+            stats_at = t;
+        }
+        if (wpos == rpos) {
+            if (server_gone(&rd)) {
+                fprintf(stderr, "Server closed the connection (%lu readers dropped so far)\n"
+                        , (unsigned long)rd.ring->dropped);
+                return 1;
+            }
+            wait_data(&rd, rpos, 1000);
+            continue;
+        }
+        // only whole messages are ever published
+        while (rpos != wpos) {
+            long len = handle_msg(&rd, rd.data + rpos % rd.ring->size);
+            if (len < 0) {
+                return 1;
+            }
+            rpos += len;
+            rd.msgs += 1;
+            rd.bytes += len;
+        }
+        // seq_cst pairs with the server setting writer_waiting, then looking again
+        __atomic_store_n(&rd.ring->read_pos, rpos, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&rd.ring->writer_waiting, 0, __ATOMIC_SEQ_CST)) {
+            eventfd_write(rd.wakefd, 1);
+        }
+    }
+}
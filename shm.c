@@ -0,0 +1,369 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+#include "x-viredero.h"
+
+// Local viewers get the protocol through a single reader ring in a memfd
+// instead of a socket. The reader connects to a unix socket, is handed
+// the memfd (SCM_RIGHTS), maps it and sends its commands back over the
+// same socket. Every message is copied into the ring exactly once and
+// read from there in place; a reader sleeping on an empty ring is woken
+// through the futex in the ring head. The other way round, a writer
+// holding damage back until the ring drains sets writer_waiting and the
+// reader kicks an eventfd passed along with the memfd. Like a slow TCP viewer, a reader
+// that lets the ring fill up is cut off and has to come back with Init.
+
+static void futex_wake(uint32_t* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// head plus the data part mapped twice, back to back
+static char* ring_map(int fd, uint64_t size) {
+    char* base = mmap(NULL, SHM_RING_HEAD_SIZE + 2 * size, PROT_NONE
+                      , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base) {
+        return NULL;
+    }
+    if (mmap(base, SHM_RING_HEAD_SIZE + size, PROT_READ | PROT_WRITE
+             , MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + SHM_RING_HEAD_SIZE + size, size, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_FIXED, fd, SHM_RING_HEAD_SIZE) == MAP_FAILED) {
+        munmap(base, SHM_RING_HEAD_SIZE + 2 * size);
+        return NULL;
+    }
+    return base;
+}
+
+static bool ring_create(struct context* ctx) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    uint64_t size = (uint64_t)ctx->cfg.shm_size_mb * 1024 * 1024;
+    char* base;
+    int fd = memfd_create("x-viredero", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        slog(LOG_ERR, "memfd_create failed: %m");
+        return false;
+    }
+    mctx->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mctx->wakefd < 0) {
+        slog(LOG_ERR, "eventfd failed: %m");
+        close(fd);
+        return false;
+    }
+    // the reader may write read_pos, but never resize it under us
+    if (ftruncate(fd, SHM_RING_HEAD_SIZE + size) < 0
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0
+        || NULL == (base = ring_map(fd, size))) {
+        slog(LOG_ERR, "Cannot set up %lu byte shared ring: %m", (unsigned long)size);
+        close(fd);
+        close(mctx->wakefd);
+        mctx->wakefd = -1;
+        return false;
+    }
+    mctx->memfd = fd;
+    mctx->ring = (struct shm_ring*)base;
+    mctx->data = base + SHM_RING_HEAD_SIZE;
+    mctx->ring->magic = SHM_RING_MAGIC;
+    mctx->ring->version = SHM_RING_VERSION;
+    mctx->ring->size = size;
+    slog(LOG_INFO, "shared ring of %d MiB", ctx->cfg.shm_size_mb);
+    return true;
+}
+
+// the memfd and the wakeup eventfd, in that order
+static bool send_fds(int sock, int memfd, int wakefd) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    int fds[2] = {memfd, wakefd};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    struct msghdr mh;
+    struct cmsghdr* cm;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == 1;
+}
+
+static void reader_close(struct shm_context* mctx) {
+    if (mctx->sock >= 0) {
+        close(mctx->sock);
+        mctx->sock = -1;
+    }
+    mctx->ready = false;
+    mctx->rlen = 0;
+}
+
+// one reader at a time, a new one takes over the ring
+static void shm_accept(struct context* ctx) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    struct shm_ring* ring = mctx->ring;
+    int fd = accept4(mctx->listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (mctx->sock >= 0) {
+        slog(LOG_NOTICE, "new reader replaces the old one");
+        reader_close(mctx);
+    }
+    // it starts at the end of whatever the last one left
+    __atomic_store_n(&ring->read_pos, __atomic_load_n(&ring->write_pos, __ATOMIC_RELAXED)
+                     , __ATOMIC_RELEASE);
+    if (!send_fds(fd, mctx->memfd, mctx->wakefd)) {
+        slog(LOG_WARNING, "Cannot pass the ring to the reader: %m");
+        close(fd);
+        return;
+    }
+    slog(LOG_NOTICE, "reader connected");
+    mctx->sock = fd;
+}
+
+static bool ring_publish(struct context* ctx, const char* head, int hlen
+                         , const char* data, int dlen) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    struct shm_ring* ring = mctx->ring;
+    uint64_t wpos = ring->write_pos;
+    uint64_t used = wpos - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE);
+    char* p;
+    if (mctx->sock < 0) {
+        return true;
+    }
+    if (used + hlen + dlen > ring->size) {
+        slog(LOG_WARNING, "reader is %lu bytes behind, dropping it", (unsigned long)used);
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        metric_add(MetricDroppedViewers, 1);
+        reader_close(mctx);
+        return false;
+    }
+    p = mctx->data + wpos % ring->size;
+    memcpy(p, head, hlen);
+    if (dlen > 0) {
+        memcpy(p + hlen, data, dlen);
+    }
+    __atomic_store_n(&ring->write_pos, wpos + hlen + dlen, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST)) {
+        futex_wake(&ring->seq);
+    }
+    return true;
+}
+
+static bool shm_img_writer(struct context* ctx, int x, int y, int width, int height
+                           , char* data, int data_len) {
+    char head[IMAGECMD_HEAD_LEN];
+    if (!ctx->w.mctx.ready) {
+        return true;
+    }
+    fill_imagecmd_header(head, data_len, width, height, x, y);
+    return ring_publish(ctx, head, IMAGECMD_HEAD_LEN, data, data_len);
+}
+
+static bool shm_pntr_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    char head[POINTERCMD_HEAD_LEN];
+    int hlen;
+    if (!ctx->w.mctx.ready) {
+        return true;
+    }
+    hlen = fill_pointercmd_header(head, pm);
+    return ring_publish(ctx, head, hlen, data, pm->len);
+}
+
+static bool shm_prim_writer(struct context* ctx, const struct primitive_msg* pm) {
+    char head[PRIMCMD_HEAD_LEN];
+    int hlen;
+    if (!ctx->w.mctx.ready) {
+        return true;
+    }
+    hlen = fill_primcmd_header(head, pm);
+    return ring_publish(ctx, head, hlen, NULL, 0);
+}
+
+static bool shm_send_reply(struct context* ctx, char* buf, int size) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    if (mctx->sock < 0 || !ring_publish(ctx, buf, size, NULL, 0)) {
+        return false;
+    }
+    mctx->ready = InitReply == buf[0] && ResultSuccess == buf[1];
+    return true;
+}
+
+static int shm_read_command(struct context* ctx, char* buf, int size) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    eventfd_t junk;
+    int len;
+    if (mctx->wakefd >= 0) {
+        eventfd_read(mctx->wakefd, &junk);
+    }
+    shm_accept(ctx);
+    if (mctx->sock < 0) {
+        return 0;
+    }
+    len = recv_command(mctx->sock, mctx->rbuf, &mctx->rlen, buf, size);
+    if (len < 0) {
+        slog(LOG_NOTICE, "reader disconnected");
+        reader_close(mctx);
+        return 0;
+    }
+    return len;
+}
+
+// the ring is sized from the tunables, so it's made once options are parsed
+static bool shm_init_conn(struct context* ctx, char* buf, int size) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    if (NULL == mctx->ring && !ring_create(ctx)) {
+        return false;
+    }
+    for (;;) {
+        struct pollfd fds[2];
+        int len = shm_read_command(ctx, buf, MAX_COMMAND_LEN);
+        if (len > 0 && Init == buf[0]) {
+            return true;
+        }
+        if (len > 0) {
+            continue;
+        }
+        fds[0].fd = mctx->listen_sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = mctx->sock;
+        fds[1].events = POLLIN;
+        if (poll(fds, mctx->sock >= 0 ? 2 : 1, -1) < 0) {
+            slog(LOG_ERR, "Waiting for a reader failed: %m");
+            return false;
+        }
+    }
+}
+
+// nothing is ever queued outside the ring
+static bool shm_flush(struct context* ctx) {
+    return true;
+}
+
+static long shm_queued(struct context* ctx) {
+    struct shm_ring* ring = ctx->w.mctx.ring;
+    if (ctx->w.mctx.sock < 0 || NULL == ring) {
+        return 0;
+    }
+    return ring->write_pos - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE);
+}
+
+// While anything is left in the ring the pump holds damage back and arms
+// no timer, so it has to hear about the reader catching up. A reader that
+// emptied the ring before it could see the flag is caught by the second look.
+static void arm_wakeup(struct context* ctx) {
+    struct shm_ring* ring = ctx->w.mctx.ring;
+    __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->read_pos, __ATOMIC_SEQ_CST) == ring->write_pos) {
+        eventfd_write(ctx->w.mctx.wakefd, 1);
+    }
+}
+
+static int shm_poll_fds(struct context* ctx, struct pollfd* fds, int max) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    int cnt = 0;
+    if (max < 3) {
+        return 0;
+    }
+    fds[cnt].fd = mctx->listen_sock;
+    fds[cnt].events = POLLIN;
+    cnt += 1;
+    if (mctx->sock >= 0) {
+        fds[cnt].fd = mctx->sock;
+        fds[cnt].events = POLLIN;
+        cnt += 1;
+        if (shm_queued(ctx) > 0) {
+            arm_wakeup(ctx);
+        }
+        fds[cnt].fd = mctx->wakefd;
+        fds[cnt].events = POLLIN;
+        cnt += 1;
+    }
+    return cnt;
+}
+
+void init_shm(struct context* ctx, const char* path) {
+    struct shm_context* mctx = &ctx->w.mctx;
+    struct sockaddr_un addr;
+    int sock;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        slog(LOG_ERR, "Socket path %s is too long", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        slog(LOG_ERR, "Socket creation failed: %m");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        slog(LOG_ERR, "Socket bind to %s failed: %m", path);
+        exit(1);
+    }
+    if (listen(sock, 2) < 0) {
+        slog(LOG_ERR, "Socket listen failed: %m");
+        exit(1);
+    }
+    mctx->listen_sock = sock;
+    mctx->sock = -1;
+    mctx->memfd = -1;
+    mctx->wakefd = -1;
+    mctx->ring = NULL;
+    mctx->data = NULL;
+    mctx->ready = false;
+    mctx->rlen = 0;
+    ctx->write_image = shm_img_writer;
+    ctx->write_pointer = shm_pntr_writer;
+    ctx->write_primitive = shm_prim_writer;
+    ctx->init_conn = shm_init_conn;
+    ctx->read_command = shm_read_command;
+    ctx->send_reply = shm_send_reply;
+    ctx->flush_out = shm_flush;
+    ctx->poll_fds = shm_poll_fds;
+    ctx->out_queued = shm_queued;
+}
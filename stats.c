@@ -0,0 +1,279 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "x-viredero.h"
+
+// Counters live in a cache line aligned block per thread. A thread only
+// ever writes its own block, with plain relaxed stores, so bumping a
+// counter costs an add and never bounces a cache line between cores.
+// The stats thread (-m) sums the blocks when somebody connects to its
+// unix socket and answers with Prometheus text, HTTP framed if the
+// request looks like one:
+//   curl --unix-socket /run/x-viredero.stats http://localhost/metrics
+//   socat - UNIX-CONNECT:/run/x-viredero.stats </dev/null
+
+#define STATS_RATE_MSEC 1000 // window of the per second gauges
+#define STATS_REQUEST_MSEC 100 // how long a client gets to say it's HTTP
+#define STATS_REQUEST_MAX 1024
+
+struct counters {
+    unsigned long v[Metrics];
+} __attribute__((aligned(64)));
+
+struct metric_desc {
+    const char* name;
+    const char* type;
+    const char* help;
+};
+
+static const struct metric_desc descs[Metrics] = {
+    [MetricCapturedBytes] = {"captured_bytes_total", "counter"
+                             , "Damaged framebuffer bytes captured from X"},
+    [MetricUnchangedBytes] = {"unchanged_bytes_total", "counter"
+                              , "Captured bytes dropped as identical to what was sent"},
+    [MetricDamageRects] = {"damage_rects_total", "counter", "Damage rectangles reported by X"},
+    [MetricCoalesced] = {"coalesced_rects_total", "counter"
+                         , "Damage rectangles merged into another before capture"},
+    [MetricDiscarded] = {"discarded_jobs_total", "counter"
+                         , "Encoded rects dropped on a scene change"},
+    [MetricDroppedViewers] = {"dropped_viewers_total", "counter"
+                              , "Viewers disconnected for falling behind"},
+    [MetricSentImages] = {"sent_images_total", "counter", "Image messages sent"},
+    [MetricSentPointers] = {"sent_pointers_total", "counter", "Pointer messages sent"},
+    [MetricSentCopies] = {"sent_copies_total", "counter", "CopyRect messages sent"},
+    [MetricSentFills] = {"sent_fills_total", "counter", "FillRect messages sent"},
+    [MetricSentBytes] = {"sent_bytes_total", "counter", "Message bytes handed to the transport"},
+    [MetricSendFailures] = {"send_failures_total", "counter", "Messages the transport refused"},
+    [MetricUsbErrors] = {"usb_errors_total", "counter", "Failed USB transfers"},
+    [MetricUsbRetries] = {"usb_retries_total", "counter", "USB transfers tried again"},
+    [MetricCodecRects] = {"encoded_rects_total", "counter", "Rects encoded"},
+    [MetricCodecRaw] = {"encoded_raw_bytes_total", "counter"
+                        , "Size of the encoded rects as 24 bit RGB"},
+    [MetricCodecBytes] = {"encoded_bytes_total", "counter", "Encoder output"},
+    [MetricQueuedBytes] = {"queued_bytes", "gauge", "Bytes waiting in the transport"},
+    [MetricJobs] = {"pipeline_jobs", "gauge", "Rects being encoded or waiting to be sent"},
+    [MetricFailCnt] = {"fail_cnt", "gauge", "Failure score, the pump gives up at 100"},
+};
+
+static const char* const codec_names[IMAGE_CODECS] = {
+    [CodecRgb] = "rgb",
+    [CodecPng] = "png",
+    [CodecWebpLossless] = "webp_lossless",
+    [CodecWebpLossy] = "webp_lossy",
+    [CodecDelta] = "delta",
+    [CodecYuv420] = "yuv420",
+    [CodecRgb565] = "rgb565",
+};
+
+static struct counters blocks[STATS_MAX_THREADS];
+static struct counters shared; // threads past STATS_MAX_THREADS, atomic adds
+static int nblocks;
+static __thread struct counters* mine;
+static int listen_sock = -1;
+
+// give the calling thread a block of its own
+void stats_thread() {
+    int i = __atomic_fetch_add(&nblocks, 1, __ATOMIC_RELAXED);
+    if (i < STATS_MAX_THREADS) {
+        mine = &blocks[i];
+    }
+}
+
+void metric_add(enum Metric m, unsigned long n) {
+    if (NULL == mine) {
+        __atomic_add_fetch(&shared.v[m], n, __ATOMIC_RELAXED);
+        return;
+    }
+    // nobody else writes here, the store only has to be untorn
+    __atomic_store_n(&mine->v[m], mine->v[m] + n, __ATOMIC_RELAXED);
+}
+
+// gauges have one writer, the sum over blocks is its value
+void metric_set(enum Metric m, unsigned long v) {
+    if (NULL == mine) {
+        __atomic_store_n(&shared.v[m], v, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(&mine->v[m], v, __ATOMIC_RELAXED);
+}
+
+void stats_gauges(struct context* ctx) {
+    metric_set(MetricQueuedBytes, ctx->out_queued ? ctx->out_queued(ctx) : 0);
+    metric_set(MetricJobs, ctx->pl.tail - ctx->pl.head);
+    metric_set(MetricFailCnt, ctx->fail_cnt);
+}
+
+static void snapshot(unsigned long* v) {
+    int n = MIN(__atomic_load_n(&nblocks, __ATOMIC_RELAXED), STATS_MAX_THREADS);
+    for (int m = 0; m < Metrics; m += 1) {
+        v[m] = __atomic_load_n(&shared.v[m], __ATOMIC_RELAXED);
+        for (int i = 0; i < n; i += 1) {
+            v[m] += __atomic_load_n(&blocks[i].v[m], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void describe(FILE* f, const char* name, const char* type, const char* help) {
+    fprintf(f, "# HELP x_viredero_%s %s\n# TYPE x_viredero_%s %s\n", name, help, name, type);
+}
+
+static void print_metrics(FILE* f, const unsigned long* v, double rects_rate) {
+    for (int m = 0; m < Metrics; m += 1) {
+        const struct metric_desc* d = &descs[m];
+        if (NULL == d->name) {
+            continue; // the rest of a per codec family
+        }
+        describe(f, d->name, d->type, d->help);
+        if (m >= MetricCodecRects && m < MetricQueuedBytes) {
+            for (int c = 0; c < IMAGE_CODECS; c += 1) {
+                fprintf(f, "x_viredero_%s{codec=\"%s\"} %lu\n", d->name, codec_names[c], v[m + c]);
+            }
+        } else {
+            fprintf(f, "x_viredero_%s %lu\n", d->name, v[m]);
+        }
+    }
+    describe(f, "compression_ratio", "gauge", "Raw over encoded bytes since start");
+    for (int c = 0; c < IMAGE_CODECS; c += 1) {
+        if (v[MetricCodecBytes + c] > 0) {
+            fprintf(f, "x_viredero_compression_ratio{codec=\"%s\"} %.3f\n", codec_names[c]
+                    , (double)v[MetricCodecRaw + c] / v[MetricCodecBytes + c]);
+        }
+    }
+    describe(f, "rects_per_second", "gauge", "Image messages sent over the last second");
+    fprintf(f, "x_viredero_rects_per_second %.1f\n", rects_rate);
+}
+
+static void reply(int conn, double rects_rate) {
+    unsigned long v[Metrics];
+    char req[STATS_REQUEST_MAX];
+    struct pollfd pfd = {conn, POLLIN, 0};
+    struct timeval timeo = {1, 0};
+    bool http = false;
+    char* text = NULL;
+    size_t size = 0;
+    FILE* f;
+    // HTTP clients speak first, anybody else gets bare text after a while
+    if (poll(&pfd, 1, STATS_REQUEST_MSEC) > 0) {
+        int len = recv(conn, req, sizeof(req), MSG_DONTWAIT);
+        http = len >= 4 && 0 == memcmp(req, "GET ", 4);
+    }
+    // a reader that stops reading must not hold up the others for good
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeo, sizeof(timeo));
+    f = open_memstream(&text, &size);
+    if (NULL == f) {
+        close(conn);
+        return;
+    }
+    if (http) {
+        fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+              "Connection: close\r\n\r\n", f);
+    }
+    snapshot(v);
+    print_metrics(f, v, rects_rate);
+    fclose(f);
+    // a scraper that hung up already must not take the server down with SIGPIPE
+    for (size_t off = 0; off < size; ) {
+        ssize_t n = send(conn, text + off, size - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        off += n;
+    }
+    free(text);
+    close(conn);
+}
+
+static void* stats_server(void* arg) {
+    unsigned long last[Metrics];
+    unsigned long last_usec = now_usec();
+    double rects_rate = 0;
+    snapshot(last);
+    for (;;) {
+        struct pollfd pfd = {listen_sock, POLLIN, 0};
+        int res = poll(&pfd, 1, STATS_RATE_MSEC);
+        unsigned long usec = now_usec();
+        if (usec - last_usec >= STATS_RATE_MSEC * 1000UL) {
+            unsigned long cur[Metrics];
+            snapshot(cur);
+            rects_rate = (cur[MetricSentImages] - last[MetricSentImages]) * 1e6
+                / (usec - last_usec);
+            memcpy(last, cur, sizeof(last));
+            last_usec = usec;
+        }
+        if (res > 0) {
+            int conn = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+            if (conn >= 0) {
+                reply(conn, rects_rate);
+            }
+        }
+    }
+    return NULL;
+}
+
+// the calling thread becomes the pump, path NULL means no stats socket
+bool stats_init(const char* path) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    stats_thread();
+    if (NULL == path) {
+        return true;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        slog(LOG_ERR, "Stats socket path %s is too long", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    listen_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_sock < 0) {
+        slog(LOG_ERR, "Stats socket creation failed: %m");
+        return false;
+    }
+    unlink(path);
+    if (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(listen_sock, 4) < 0) {
+        slog(LOG_ERR, "Stats socket %s: %m", path);
+        return false;
+    }
+    if (pthread_create(&thread, NULL, stats_server, NULL) != 0) {
+        slog(LOG_ERR, "Cannot start stats thread: %m");
+        return false;
+    }
+    pthread_detach(thread);
+    slog(LOG_INFO, "stats on %s", path);
+    return true;
+}
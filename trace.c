@@ -0,0 +1,206 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/param.h>
+
+#include "x-viredero.h"
+
+// Every message sent keeps the TracePoint timestamps it collected on the
+// way through the pipeline. They go into a histogram per stage (all on
+// the pump thread, a few adds per message) and into a ring of the last
+// TRACE_RING_SIZE messages that is written out as Chrome trace-event
+// JSON (chrome://tracing, Perfetto) on SIGUSR1 and on exit.
+//
+// TpDone is when the transport was next seen with nothing queued, so the
+// last stage is an upper bound, exact for transports that wake the pump
+// when their queue moves.
+
+#define SUB (1 << TRACE_HIST_SUB_BITS)
+
+static const char* const stage_names[TracePoints] = {
+    [TpEvent] = "hold", // event -> capture
+    [TpCapture] = "capture",
+    [TpQueued] = "wait", // for an encoder
+    [TpEncodeStart] = "encode",
+    [TpEncoded] = "order", // finished -> its turn to be sent
+    [TpSent] = "wire",
+    [TpDone] = "total",
+};
+
+static int bucket(unsigned long v) {
+    int e;
+    if (v < 2 * SUB) {
+        return v;
+    }
+    e = 63 - __builtin_clzl(v); // top bit
+    return (e - TRACE_HIST_SUB_BITS + 1) * SUB + (v >> (e - TRACE_HIST_SUB_BITS)) - SUB;
+}
+
+// smallest value that lands in bucket b
+static unsigned long bucket_floor(int b) {
+    int e;
+    if (b < 2 * SUB) {
+        return b;
+    }
+    e = b / SUB + TRACE_HIST_SUB_BITS - 1;
+    return (unsigned long)(b % SUB + SUB) << (e - TRACE_HIST_SUB_BITS);
+}
+
+static void hist_add(struct histogram* h, unsigned long v) {
+    h->counts[bucket(v)] += 1;
+    h->cnt += 1;
+    h->max = MAX(h->max, v);
+}
+
+static unsigned long hist_percentile(const struct histogram* h, int pct) {
+    unsigned long want = (h->cnt * pct + 99) / 100;
+    unsigned long seen = 0;
+    for (int b = 0; b < TRACE_HIST_BUCKETS; b += 1) {
+        seen += h->counts[b];
+        if (seen >= want && seen > 0) {
+            return MIN(bucket_floor(b), h->max);
+        }
+    }
+    return h->max;
+}
+
+bool trace_init(struct trace* tr, const char* path) {
+    memset(tr->hist, 0, sizeof(tr->hist));
+    tr->ring = calloc(TRACE_RING_SIZE, sizeof(struct trace_rec));
+    tr->head = 0;
+    tr->undone = 0;
+    tr->path = path;
+    if (NULL == tr->ring) {
+        slog(LOG_ERR, "Cannot allocate trace ring");
+        return false;
+    }
+    return true;
+}
+
+void trace_sent(struct trace* tr, const struct job* job) {
+    struct trace_rec* r;
+    if (NULL == tr->ring) {
+        return;
+    }
+    if (tr->head - tr->undone == TRACE_RING_SIZE) {
+        tr->undone += 1; // never saw the transport drain, give up on it
+    }
+    r = &tr->ring[tr->head % TRACE_RING_SIZE];
+    memcpy(r->stamp, job->stamp, sizeof(job->stamp));
+    r->stamp[TpSent] = now_usec();
+    r->stamp[TpDone] = 0;
+    r->x = job->x;
+    r->y = job->y;
+    r->width = job->width;
+    r->height = job->height;
+    r->len = job->len;
+    r->type = job->type;
+    r->encoder = job->encoder;
+    // the wire stage ends in trace_transport
+    for (int i = TpEvent; i < TpSent; i += 1) {
+        hist_add(&tr->hist[i], r->stamp[i + 1] - r->stamp[i]);
+    }
+    tr->head += 1;
+}
+
+// call whenever the transport may have moved; an empty queue completes
+// everything handed to it so far
+void trace_transport(struct context* ctx) {
+    struct trace* tr = &ctx->trace;
+    unsigned long t;
+    if (tr->undone == tr->head || (ctx->out_queued != NULL && ctx->out_queued(ctx) > 0)) {
+        return;
+    }
+    t = now_usec();
+    for (; tr->undone != tr->head; tr->undone += 1) {
+        struct trace_rec* r = &tr->ring[tr->undone % TRACE_RING_SIZE];
+        r->stamp[TpDone] = t;
+        hist_add(&tr->hist[TpSent], t - r->stamp[TpSent]);
+        hist_add(&tr->hist[TpDone], t - r->stamp[TpEvent]);
+    }
+}
+
+// p50/p99/max per stage since the last call
+void trace_log(struct trace* tr) {
+    char line[512];
+    int len = 0;
+    for (int i = 0; i < TracePoints; i += 1) {
+        struct histogram* h = &tr->hist[i];
+        len += snprintf(line + len, sizeof(line) - len, " %s %lu/%lu/%lu", stage_names[i]
+                        , hist_percentile(h, 50), hist_percentile(h, 99), h->max);
+    }
+    slog(LOG_INFO, "latency usec p50/p99/max:%s, %lu messages\n", line, tr->hist[TpEvent].cnt);
+    memset(tr->hist, 0, sizeof(tr->hist));
+}
+
+// main thread stages each get a row, encoders one each
+static int stage_tid(int stage, const struct trace_rec* r) {
+    return TpEncodeStart == stage ? 10 + r->encoder : 1 + stage;
+}
+
+bool trace_dump(struct trace* tr) {
+    unsigned long first = tr->head > TRACE_RING_SIZE ? tr->head - TRACE_RING_SIZE : 0;
+    bool comma = false;
+    FILE* f;
+    if (NULL == tr->path || NULL == tr->ring) {
+        return false;
+    }
+    f = fopen(tr->path, "w");
+    if (NULL == f) {
+        slog(LOG_ERR, "Cannot write trace to %s: %m", tr->path);
+        return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = TpEvent; i < TpDone; i += 1) {
+        if (i != TpEncodeStart) {
+            fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d"
+                    ",\"args\":{\"name\":\"%s\"}}", comma ? ",\n" : "", 1 + i, stage_names[i]);
+            comma = true;
+        }
+    }
+    for (unsigned long n = first; n < tr->head; n += 1) {
+        const struct trace_rec* r = &tr->ring[n % TRACE_RING_SIZE];
+        const char* what = JobPointer == r->type ? "pointer"
+            : JobPrimitive == r->type ? "primitive" : "image";
+        for (int i = TpEvent; i < TpDone; i += 1) {
+            if (0 == r->stamp[i + 1] || r->stamp[i + 1] == r->stamp[i]) {
+                continue;
+            }
+            fprintf(f, ",\n{\"ph\":\"X\",\"name\":\"%s %s\",\"pid\":1,\"tid\":%d,\"ts\":%lu"
+                    ",\"dur\":%lu,\"args\":{\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"bytes\":%d}}"
+                    , what, stage_names[i], stage_tid(i, r), r->stamp[i]
+                    , r->stamp[i + 1] - r->stamp[i], r->x, r->y, r->width, r->height, r->len);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        slog(LOG_ERR, "Cannot write trace to %s: %m", tr->path);
+        return false;
+    }
+    slog(LOG_NOTICE, "trace of %lu messages written to %s", tr->head - first, tr->path);
+    return true;
+}
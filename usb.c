@@ -24,9 +24,11 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <syslog.h>
 
+#include <sys/param.h>
 #include <arpa/inet.h>
 
 #include <libusb-1.0/libusb.h>
@@ -40,7 +42,11 @@
 #define USB_URI "http://play.google.com/"
 #define USB_SERIAL_NUM "130"
 #define USB_XFER_TIMEO_MSEC 1000
-#define USB_CHECK_TIMEO_MSEC 10
+#define USB_CHUNK_SIZE (128 * 1024)
+#define USB_SPARE_CHUNKS 4
+#define USB_CTL_BUF_SIZE 512 // max packet multiple, a short client write never overflows
+#define USB_CTL_RING 16
+#define USB_CTL_MAX_ERRORS 8 // failed control transfers in a row before giving up
 #define USB_ACCESSORY_VID 0x18D1
 #define USB_ACCESSORY_PID_MASK 0xFFF0
 #define USB_ACCESSORY_PID 0x2D00
@@ -52,6 +58,42 @@
 
 static libusb_hotplug_callback_handle callback_handle;
 
+// Output is one byte stream cut into chunks. Messages are appended to the
+// last queued chunk, so whatever arrives while all USB_OUT_XFERS transfers
+// are busy goes out together in the next one. Completions are reaped from
+// the pump through flush_out when libusb's fds fire. Client commands come
+// in the same way, through an IN transfer that is always posted.
+
+struct usb_chunk {
+    struct usb_chunk* next;
+    int len;
+    unsigned char data[USB_CHUNK_SIZE];
+};
+
+struct usb_ctl_event {
+    char cmd[MAX_COMMAND_LEN];
+    int len;
+};
+
+struct usb_in {
+    struct context* ctx;
+    struct libusb_transfer* xfer;
+    bool posted;
+    int errors; // failed in a row
+    unsigned char buf[USB_CTL_BUF_SIZE];
+    char partial[MAX_COMMAND_LEN]; // command split between transfers
+    int partial_len;
+    struct usb_ctl_event ring[USB_CTL_RING];
+    unsigned head; // next to read
+    unsigned tail; // next to write
+};
+
+struct usb_out {
+    struct context* ctx;
+    struct libusb_transfer* xfer;
+    struct usb_chunk* chunk; // NULL when the transfer is idle
+};
+
 static bool xfer_or_die(libusb_device_handle* hndl, int wIdx, char* str) {
     int res = libusb_control_transfer(hndl, 0x40, 52, 0, wIdx
                                       , str, strlen(str), 0);
@@ -117,117 +159,337 @@ static bool try_setup_accessory(struct context* ctx, libusb_device* dev) {
     return res;
 }
 
-static bool usb_write(struct context* ctx, char* data, int size) {
-    int sent = 0;
-    while (size > 0) {
-        int response = libusb_bulk_transfer(ctx->w.uctx.hndl, BLK_OUT_ENDPOINT, data
-                                            , size, &sent, USB_XFER_TIMEO_MSEC);
-        if (response != 0) {
-            slog(LOG_ERR, "USB transfer failed: %s", libusb_strerror(response));
-            if (LIBUSB_ERROR_NO_DEVICE == response) {
-                ctx->w.uctx.hndl = NULL;
+static void free_chunk(struct usb_context* uctx, struct usb_chunk* chunk) {
+    int spare = 0;
+    for (struct usb_chunk* c = uctx->spare; c != NULL; c = c->next) {
+        spare += 1;
+    }
+    if (spare >= USB_SPARE_CHUNKS) {
+        free(chunk);
+        return;
+    }
+    chunk->next = uctx->spare;
+    uctx->spare = chunk;
+}
+
+static struct usb_chunk* new_chunk(struct usb_context* uctx) {
+    struct usb_chunk* chunk = uctx->spare;
+    if (chunk != NULL) {
+        uctx->spare = chunk->next;
+    } else {
+        chunk = malloc(sizeof(struct usb_chunk));
+        if (NULL == chunk) {
+            return NULL;
+        }
+    }
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+static void LIBUSB_CALL out_done(struct libusb_transfer* xfer) {
+    struct usb_out* out = (struct usb_out*)xfer->user_data;
+    struct context* ctx = out->ctx;
+    struct usb_context* uctx = &ctx->w.uctx;
+    uctx->queued -= out->chunk->len;
+    free_chunk(uctx, out->chunk);
+    out->chunk = NULL;
+    if (LIBUSB_TRANSFER_COMPLETED == xfer->status && xfer->actual_length == xfer->length) {
+        return;
+    }
+    slog(LOG_ERR, "USB transfer failed: status %d, %d of %d bytes"
+         , xfer->status, xfer->actual_length, xfer->length);
+    metric_add(MetricUsbErrors, 1);
+    if (LIBUSB_TRANSFER_NO_DEVICE == xfer->status) {
+        uctx->hndl = NULL;
+        ctx->fin = 1;
+    }
+    uctx->failed = true;
+}
+
+// put queued chunks on idle transfers
+static void usb_kick(struct context* ctx) {
+    struct usb_context* uctx = &ctx->w.uctx;
+    for (int i = 0; i < USB_OUT_XFERS && uctx->out_head != NULL && uctx->hndl != NULL; i += 1) {
+        struct usb_out* out = &uctx->out[i];
+        struct usb_chunk* chunk;
+        int res;
+        if (out->chunk != NULL) {
+            continue;
+        }
+        chunk = uctx->out_head;
+        uctx->out_head = chunk->next;
+        if (NULL == uctx->out_head) {
+            uctx->out_tail = NULL;
+        }
+        libusb_fill_bulk_transfer(out->xfer, uctx->hndl, BLK_OUT_ENDPOINT, chunk->data
+                                  , chunk->len, out_done, out, 0);
+        res = libusb_submit_transfer(out->xfer);
+        if (res != 0) {
+            slog(LOG_ERR, "USB: submitting transfer failed: %s", libusb_strerror(res));
+            metric_add(MetricUsbErrors, 1);
+            if (LIBUSB_ERROR_NO_DEVICE == res) {
+                uctx->hndl = NULL;
                 ctx->fin = 1;
             }
-            return false;
+            uctx->queued -= chunk->len;
+            free_chunk(uctx, chunk);
+            uctx->failed = true;
+            continue;
         }
-        size -= sent;
-        data += sent;
+        out->chunk = chunk;
+    }
+}
+
+static bool usb_enqueue(struct context* ctx, const char* data, int size) {
+    struct usb_context* uctx = &ctx->w.uctx;
+    if (NULL == uctx->hndl) {
+        return false;
+    }
+    while (size > 0) {
+        struct usb_chunk* chunk = uctx->out_tail;
+        int n;
+        if (NULL == chunk || USB_CHUNK_SIZE == chunk->len) {
+            chunk = new_chunk(uctx);
+            if (NULL == chunk) {
+                slog(LOG_ERR, "USB: out of memory for output");
+                return false;
+            }
+            if (uctx->out_tail != NULL) {
+                uctx->out_tail->next = chunk;
+            } else {
+                uctx->out_head = chunk;
+            }
+            uctx->out_tail = chunk;
+        }
+        n = MIN(size, USB_CHUNK_SIZE - chunk->len);
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        uctx->queued += n;
+        data += n;
+        size -= n;
     }
     return true;
 }
 
+// report (and forget) failures of transfers that completed since last time
+static bool usb_result(struct usb_context* uctx) {
+    bool res = !uctx->failed;
+    uctx->failed = false;
+    return res;
+}
+
+static bool usb_write(struct context* ctx, char* data, int size) {
+    bool res = usb_enqueue(ctx, data, size);
+    usb_kick(ctx);
+    return usb_result(&ctx->w.uctx) && res;
+}
+
+static bool usb_flush(struct context* ctx) {
+    struct timeval zero = {0, 0};
+    libusb_handle_events_timeout_completed(NULL, &zero, NULL);
+    usb_kick(ctx);
+    return usb_result(&ctx->w.uctx);
+}
+
+static long usb_queued(struct context* ctx) {
+    return ctx->w.uctx.queued;
+}
+
+static int usb_poll_fds(struct context* ctx, struct pollfd* fds, int max) {
+    const struct libusb_pollfd** pfds = libusb_get_pollfds(NULL);
+    int cnt = 0;
+    if (NULL == pfds) {
+        return 0;
+    }
+    for (; pfds[cnt] != NULL && cnt < max; cnt += 1) {
+        fds[cnt].fd = pfds[cnt]->fd;
+        fds[cnt].events = pfds[cnt]->events;
+    }
+    libusb_free_pollfds(pfds);
+    return cnt;
+}
+
 static bool usb_img_writer(struct context* ctx, int x, int y, int width, int height
                            , char* data, int data_len) {
-    char* header = fill_imagecmd_header(data, data_len, width, height, x, y);
-    int size = data_len + IMAGECMD_HEAD_LEN;
-    return usb_write(ctx, header, size);
+    char head[IMAGECMD_HEAD_LEN];
+    fill_imagecmd_header(head, data_len, width, height, x, y);
+    return usb_enqueue(ctx, head, IMAGECMD_HEAD_LEN) && usb_write(ctx, data, data_len);
 }
 
-static bool usb_pntr_writer(struct context* ctx, int x, int y
-                           , int width, int height, char* pointer) {
-    int size;
-    char* data;
-    if (width > 0) {
-        data = pointer - 9;
-        data[0] = 1;
-        ((int*)(data + 1))[0] = htonl(width);
-        ((int*)(data + 1))[1] = htonl(height);
-        data -= 9;
-        size = POINTERCMD_HEAD_LEN + width * height * 4;
-    } else {
-        data = pointer;
-        data[9] = 0; // no pointer data
-        size = 10;
-    }
-    data[0] = (char)Pointer;
-    ((int*)(data + 1))[0] = htonl(x);
-    ((int*)(data + 1))[1] = htonl(y);
-    return usb_write(ctx, data, size);
+static bool usb_pntr_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    char head[POINTERCMD_HEAD_LEN];
+    int hlen = fill_pointercmd_header(head, pm);
+    return usb_enqueue(ctx, head, hlen) && usb_write(ctx, data, pm->len);
 }
 
-static bool usb_init_conn(struct context* ctx, char* buf, int size) {
-    int received = 0;
-    int response = LIBUSB_ERROR_TIMEOUT;
-    slog(LOG_DEBUG, "USB: init connection");
-    if(NULL == ctx->w.uctx.hndl) {
-        return false;
+static bool usb_prim_writer(struct context* ctx, const struct primitive_msg* pm) {
+    char head[PRIMCMD_HEAD_LEN];
+    int hlen = fill_primcmd_header(head, pm);
+    return usb_write(ctx, head, hlen);
+}
+
+static void post_ctl(struct context* ctx);
+
+// byte stream from the client into whole commands on the event ring
+static void ctl_feed(struct usb_in* in, const unsigned char* data, int len) {
+    for (int i = 0; i < len; i += 1) {
+        int cmd_len;
+        in->partial[in->partial_len++] = data[i];
+        cmd_len = command_len(in->partial, in->partial_len);
+        if (cmd_len < 0) {
+            slog(LOG_WARNING, "USB: bad command %d from client", in->partial[0]);
+            in->partial_len = 0;
+        } else if (cmd_len > 0 && cmd_len == in->partial_len) {
+            if (in->tail - in->head == USB_CTL_RING) {
+                slog(LOG_WARNING, "USB: control ring full, command %d dropped", in->partial[0]);
+            } else {
+                struct usb_ctl_event* ev = &in->ring[in->tail % USB_CTL_RING];
+                memcpy(ev->cmd, in->partial, cmd_len);
+                ev->len = cmd_len;
+                in->tail += 1;
+            }
+            in->partial_len = 0;
+        }
     }
-    while (size > 0 && (LIBUSB_ERROR_TIMEOUT == response || 0 == response)) {
-        int t = 0;
-        response = libusb_bulk_transfer(ctx->w.uctx.hndl, BLK_IN_ENDPOINT, buf
-                                        , size, &t
-                                        , USB_XFER_TIMEO_MSEC);
-        slog(LOG_DEBUG, "USB: init: receive %d/%d bytes", t, size);
-        buf += t;
-        size -= t;
+}
+
+static void LIBUSB_CALL ctl_done(struct libusb_transfer* xfer) {
+    struct usb_in* in = (struct usb_in*)xfer->user_data;
+    struct context* ctx = in->ctx;
+    in->posted = false;
+    switch (xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        in->errors = 0;
+        ctl_feed(in, xfer->buffer, xfer->actual_length);
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        ctx->w.uctx.hndl = NULL;
+        ctx->fin = 1;
+        return;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return;
+    default:
+        slog(LOG_WARNING, "USB: control transfer failed: status %d", xfer->status);
+        metric_add(MetricUsbErrors, 1);
+        // an error that comes straight back would spin the pump on reposts
+        in->errors += 1;
+        if (in->errors >= USB_CTL_MAX_ERRORS) {
+            slog(LOG_ERR, "USB: control transfer keeps failing, giving up");
+            ctx->fin = 1;
+            return;
+        }
+        metric_add(MetricUsbRetries, 1);
+        break;
     }
-    if (response != 0) {
-        slog(LOG_ERR, "USB: didn't get Init cmd: %s", libusb_strerror(response));
-        if (LIBUSB_ERROR_NO_DEVICE == response) {
-            ctx->w.uctx.hndl = NULL;
+    post_ctl(ctx);
+}
+
+// keep one IN transfer waiting for the client at all times
+static void post_ctl(struct context* ctx) {
+    struct usb_context* uctx = &ctx->w.uctx;
+    struct usb_in* in = uctx->in;
+    int res;
+    if (NULL == in || in->posted || NULL == uctx->hndl) {
+        return;
+    }
+    libusb_fill_bulk_transfer(in->xfer, uctx->hndl, BLK_IN_ENDPOINT, in->buf
+                              , sizeof(in->buf), ctl_done, in, 0);
+    res = libusb_submit_transfer(in->xfer);
+    if (res != 0) {
+        slog(LOG_ERR, "USB: posting control transfer failed: %s", libusb_strerror(res));
+        metric_add(MetricUsbErrors, 1);
+        return;
+    }
+    in->posted = true;
+}
+
+// commands were collected by ctl_done while the pump reaped completions
+static int usb_read_command(struct context* ctx, char* buf, int size) {
+    struct usb_in* in = ctx->w.uctx.in;
+    struct usb_ctl_event* ev;
+    if (NULL == in) {
+        return 0;
+    }
+    post_ctl(ctx); // retry if resubmitting failed
+    if (in->head == in->tail) {
+        return 0;
+    }
+    ev = &in->ring[in->head % USB_CTL_RING];
+    in->head += 1;
+    if (ev->len > size) {
+        return 0;
+    }
+    memcpy(buf, ev->cmd, ev->len);
+    return ev->len;
+}
+
+// next Init the client sent, whatever came before it is dropped
+static bool ctl_take_init(struct usb_in* in, char* buf, int size) {
+    while (in->head != in->tail) {
+        struct usb_ctl_event* ev = &in->ring[in->head % USB_CTL_RING];
+        in->head += 1;
+        if (Init == ev->cmd[0] && ev->len <= size) {
+            memcpy(buf, ev->cmd, ev->len);
+            return true;
         }
-        return false;
     }
-    return true;
+    return false;
 }
 
-static bool usb_check_reinit(struct context* ctx, char* buf, int size) {
-    int received = 0;
-    int response;
-    int t = 0;
-    if (NULL == ctx->w.uctx.hndl) {
-        return false;
+// Handshake retried after a refused Init: the posted transfer gets the
+// client's next one, a synchronous read would wait for it forever.
+static bool ctl_init_conn(struct context* ctx, char* buf, int size) {
+    struct timeval tv = {USB_XFER_TIMEO_MSEC / 1000, USB_XFER_TIMEO_MSEC % 1000 * 1000};
+    for (;;) {
+        post_ctl(ctx);
+        if (ctl_take_init(ctx->w.uctx.in, buf, size)) {
+            return true;
+        }
+        if (NULL == ctx->w.uctx.hndl || ctx->fin) {
+            return false;
+        }
+        libusb_handle_events_timeout_completed(NULL, &tv, NULL);
     }
-    slog(LOG_DEBUG, "USB: check if remote side trying to reinit");
-    response = libusb_bulk_transfer(ctx->w.uctx.hndl, BLK_IN_ENDPOINT, buf
-                             , size, &t
-                             , USB_CHECK_TIMEO_MSEC);
-    if (LIBUSB_ERROR_TIMEOUT == response) {
+}
+
+// The client writes a whole Init (v2 is 12 bytes) in one packet, so the
+// read has to take a full packet and the bytes are framed like the
+// posted transfer's.
+static bool usb_init_conn(struct context* ctx, char* buf, int size) {
+    struct usb_in* in = ctx->w.uctx.in;
+    int response = LIBUSB_ERROR_TIMEOUT;
+    slog(LOG_DEBUG, "USB: init connection");
+    if(NULL == ctx->w.uctx.hndl) {
         return false;
     }
-
-    slog(LOG_DEBUG, "USB: remote side reinit attempt detected");
-    buf += t;
-    size -= t;
-    while (size > 0 && (LIBUSB_ERROR_TIMEOUT == response || 0 == response)) {
-        response = libusb_bulk_transfer(ctx->w.uctx.hndl, BLK_IN_ENDPOINT, buf
-                                        , size, &t
+    if (in->posted) {
+        return ctl_init_conn(ctx, buf, size);
+    }
+    while (!ctl_take_init(in, buf, size)
+           && (LIBUSB_ERROR_TIMEOUT == response || 0 == response)) {
+        int t = 0;
+        response = libusb_bulk_transfer(ctx->w.uctx.hndl, BLK_IN_ENDPOINT
+                                        , in->buf, sizeof(in->buf), &t
                                         , USB_XFER_TIMEO_MSEC);
-        slog(LOG_DEBUG, "USB: reinit: receive %d/%d bytes", t, size);
-        buf += t;
-        size -= t;
+        slog(LOG_DEBUG, "USB: init: receive %d bytes", t);
+        if (LIBUSB_ERROR_TIMEOUT == response) {
+            metric_add(MetricUsbRetries, 1);
+        }
+        ctl_feed(in, in->buf, t);
     }
-    if (response != 0) {
+    if (response != 0 && response != LIBUSB_ERROR_TIMEOUT) {
         slog(LOG_ERR, "USB: didn't get Init cmd: %s", libusb_strerror(response));
         if (LIBUSB_ERROR_NO_DEVICE == response) {
             ctx->w.uctx.hndl = NULL;
         }
         return false;
     }
+    // from now on the client is heard through the posted transfer
+    post_ctl(ctx);
     return true;
 }
 
-
 static libusb_device* get_by_bus_port(libusb_device*** devs, uint8_t bus, uint8_t port) {
     int cnt = libusb_get_device_list(NULL, devs);
     if (cnt < 0) {
@@ -248,9 +510,13 @@ static libusb_device* get_by_bus_port(libusb_device*** devs, uint8_t bus, uint8_
 void init_usb(struct context* ctx, int bus, int port) {
     ctx->write_image = usb_img_writer;
     ctx->write_pointer = usb_pntr_writer;
+    ctx->write_primitive = usb_prim_writer;
     ctx->init_conn = usb_init_conn;
-    ctx->check_reinit = usb_check_reinit;
+    ctx->read_command = usb_read_command;
     ctx->send_reply = usb_write;
+    ctx->flush_out = usb_flush;
+    ctx->poll_fds = usb_poll_fds;
+    ctx->out_queued = usb_queued;
     libusb_init(NULL);
     libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_INFO);
     slog(LOG_NOTICE, "USB: trying %d.%d", bus, port);
@@ -279,6 +545,15 @@ void init_usb(struct context* ctx, int bus, int port) {
     if (res < 0) {
         slog(LOG_ERR, "USB: failed to open: %s", libusb_strerror(res));
         ctx->w.uctx.hndl = NULL;
+        return;
+    }
+    ctx->w.uctx.out = calloc(USB_OUT_XFERS, sizeof(struct usb_out));
+    for (int i = 0; i < USB_OUT_XFERS; i += 1) {
+        ctx->w.uctx.out[i].ctx = ctx;
+        ctx->w.uctx.out[i].xfer = libusb_alloc_transfer(0);
     }
+    ctx->w.uctx.in = calloc(1, sizeof(struct usb_in));
+    ctx->w.uctx.in->ctx = ctx;
+    ctx->w.uctx.in->xfer = libusb_alloc_transfer(0);
 }
 
@@ -0,0 +1,195 @@
+/*
+ * X11 state change collector for viredero
+ * Copyright (c) 2015 Leonid Movshovich <event.riga@gmail.com>
+ *
+ *
+ * viredero is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * viredero is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with viredero; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "x-viredero.h"
+
+static int log_level = LOG_NOTICE;
+
+void set_log_level(int level) {
+    log_level = level;
+}
+
+void slog(int prio, char* format, ...) {
+    if (prio > log_level) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    vsyslog(prio, format, ap);
+    va_end(ap);
+}
+
+unsigned long now() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+unsigned long now_usec() {
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+void fill_imagecmd_header(char* cmd, int data_len, int w, int h, int x, int y) {
+    int* header = (int*)(cmd + 1);
+    *cmd = (char)Image;
+    header[0] = htonl(w);
+    header[1] = htonl(h);
+    header[2] = htonl(x);
+    header[3] = htonl(y);
+    header[4] = htonl(data_len);
+}
+
+static const int pointer_head_len[] = {
+    [PointerMove] = 10,
+    [PointerImage] = 18,
+    [PointerDefine] = POINTERCMD_HEAD_LEN,
+    [PointerCached] = 14,
+};
+
+int fill_pointercmd_header(char* cmd, const struct pointer_msg* pm) {
+    int* field = (int*)(cmd + 10);
+    cmd[0] = (char)Pointer;
+    ((int*)(cmd + 1))[0] = htonl(pm->x);
+    ((int*)(cmd + 1))[1] = htonl(pm->y);
+    cmd[9] = pm->kind;
+    switch (pm->kind) {
+    case PointerMove:
+        break;
+    case PointerImage:
+        field[0] = htonl(pm->width);
+        field[1] = htonl(pm->height);
+        break;
+    case PointerDefine:
+        field[0] = htonl(pm->width);
+        field[1] = htonl(pm->height);
+        field[2] = htonl(pm->slot);
+        field[3] = htonl(pm->len);
+        break;
+    case PointerCached:
+        field[0] = htonl(pm->slot);
+        break;
+    }
+    return pointer_head_len[pm->kind];
+}
+
+// whole message, header and payload
+int pointercmd_len(const struct pointer_msg* pm) {
+    return pointer_head_len[pm->kind] + pm->len;
+}
+
+// primitives have no payload, this is the whole message
+int primcmd_len(const struct primitive_msg* pm) {
+    return CopyRect == pm->type ? PRIMCMD_HEAD_LEN : 20;
+}
+
+int fill_primcmd_header(char* cmd, const struct primitive_msg* pm) {
+    int* field = (int*)(cmd + 1);
+    cmd[0] = (char)pm->type;
+    field[0] = htonl(pm->x);
+    field[1] = htonl(pm->y);
+    field[2] = htonl(pm->width);
+    field[3] = htonl(pm->height);
+    if (CopyRect == pm->type) {
+        field[4] = htonl(pm->src_x);
+        field[5] = htonl(pm->src_y);
+    } else {
+        cmd[17] = pm->color >> 16;
+        cmd[18] = pm->color >> 8;
+        cmd[19] = pm->color;
+    }
+    return primcmd_len(pm);
+}
+
+// length of the client command starting at buf, 0 if len bytes don't
+// tell yet, -1 if it's garbage
+int command_len(const char* buf, int len) {
+    if (len < 1) {
+        return 0;
+    }
+    switch (buf[0]) {
+    case Init:
+        return len < 2 ? 0 : buf[1] >= 2 ? INIT_V2_CMD_LEN : INIT_CMD_LEN;
+    case Viewport:
+        return VIEWPORT_CMD_LEN;
+    case SceneChange:
+    case ReCenter:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+// Pull the next command off a non-blocking stream into buf. Bytes of a
+// command that isn't complete yet wait in rbuf/rlen. Returns the
+// command length, 0 if there's none yet, -1 when the peer is gone.
+int recv_command(int fd, char* rbuf, int* rlen, char* buf, int size) {
+    for (;;) {
+        int len = command_len(rbuf, *rlen);
+        ssize_t got;
+        if (len < 0 || len > size) {
+            slog(LOG_WARNING, "bad command %d from client", rbuf[0]);
+            *rlen = 0;
+            continue;
+        }
+        if (len > 0 && *rlen == len) {
+            memcpy(buf, rbuf, len);
+            *rlen = 0;
+            return len;
+        }
+        // never read past the current command, byte by byte while its
+        // length isn't known
+        got = recv(fd, rbuf + *rlen, MAX(len, *rlen + 1) - *rlen, MSG_DONTWAIT);
+        if (got < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+            return 0;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        *rlen += got;
+    }
+}
+
+bool dummy_pointer_writer(struct context* ctx, const struct pointer_msg* pm, char* data) {
+    return true;
+}
+
+void update_fail_cnt(struct context* ctx, bool res) {
+    if (res) {
+        ctx->fail_cnt = 0;
+    } else {
+        ctx->fail_cnt += 1;
+    }
+}
@@ -29,110 +29,193 @@
 #include <syslog.h>
 
 #include <sys/shm.h>
+#include <sys/param.h>
 #include <arpa/inet.h>
 
 #include <X11/Xlibint.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/extensions/Xrandr.h>
-#include <cairo/cairo.h>
-#include <cairo/cairo-xlib.h>
-
-#include <webp/encode.h>
 
 #include "x-viredero.h"
 
 #define PROG "x-viredero"
 #define DISP_NAME_MAXLEN 64
-#define DATA_BUFFER_HEAD 32
-#define INIT_CMD_LEN 4
-#define MAX_INIT_BUF_SIZE 12 // maximum size required for init_reply cmd
-#define MAX_VIREDERO_PROT_VERSION 1
+#define MAX_VIREDERO_PROT_VERSION 2
 #define CURSOR_MAX_SIZE 64
 #define CURSOR_BUFFER_SIZE (4 * CURSOR_MAX_SIZE * CURSOR_MAX_SIZE + POINTERCMD_HEAD_LEN)
-#define POINTER_CHECK_INTERVAL_MSEC 50
+#define POINTER_CHECK_INTERVAL_MSEC 50 // without XInput2
 #define FPS_LOG_INTERVAL_MSEC 30000
 #define FAILURES_EXIT_PUMP 100
-#define USE_PNG 1
-
-static char* image_buffer;
-
-struct png_wr_ctx {
-    char* out;
-    int offset;
-};
-
-static int log_level = LOG_NOTICE;
-void slog(int prio, char* format, ...) {
-    if (prio > log_level) {
-        return;
-    }
-    va_list ap;
-    va_start(ap, format);
-    vsyslog(prio, format, ap);
-    va_end(ap);
-}
+#define DEFAULT_FPS 60
+#define MAX_ENCODER_THREADS 16
+#define DAMAGE_RECT_COST 4096 // pixels we'd rather send than pay for another message
+#define MAX_SCALE 8
 
 static void usage() {
     printf("USAGE: %s <opts>\n", PROG);
 }
 
-unsigned long now() {
-    struct timespec tp;
-    clock_gettime(CLOCK_MONOTONIC, &tp);
-    return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
-}
-
-char* fill_imagecmd_header(char* data, int data_len, int w, int h, int x, int y) {
-    char* cmd = data - IMAGECMD_HEAD_LEN;
-    int* header = (int*)(cmd + 1);
-    *cmd = (char)Image;
-    header[0] = htonl(w);
-    header[1] = htonl(h);
-    header[2] = htonl(x);
-    header[3] = htonl(y);
-    header[4] = htonl(data_len);
-    return cmd;
+static XImage* capture_rect(struct context* ctx, int x, int y, int width, int height) {
+    XImage* ximage = ctx->p.bmp.shmimage;
+    ximage->width = width;
+    ximage->height = height;
+    // the server packs the rect with its own scanline pad, not ours
+    ximage->bytes_per_line = (width * ximage->bits_per_pixel + ximage->bitmap_pad - 1)
+        / ximage->bitmap_pad * (ximage->bitmap_pad / 8);
+    if (!XShmGetImage(ctx->display, ctx->root
+                      , ximage, x, y, AllPlanes)) {
+        slog(LOG_ERR, "unabled to get the image\n");
+        return NULL;
+    }
+    return ximage;
 }
 
-static void cursor2rgba(unsigned long* cur_data, char* rgba_data, unsigned long len) {
-// cursor is in argb format
-    int cur_idx = len/4;
-    while (len > 0) {
-        len -= 4;
-        cur_idx -= 1;
-        rgba_data[len + 3] = (cur_data[cur_idx] >> 24) & 0xFF;
-        rgba_data[len + 0] = (cur_data[cur_idx] >> 16) & 0xFF;
-        rgba_data[len + 1] = (cur_data[cur_idx] >>  8) & 0xFF;
-        rgba_data[len + 2] = (cur_data[cur_idx]) & 0xFF;
+// x, y, width, height are root window pixels, the rest of the way fb ones
+static bool output_damage(struct context* ctx, int x, int y, int width, int height) {
+//    slog(LOG_DEBUG, "outputing damage: %d %d %d %d\n", x, y, width, height);
+    XRectangle area = {x, y, width, height};
+    int scale = ctx->scale;
+    if (!fb_scale_rect(&ctx->fb, scale, &area)) {
+        return true;
+    }
+    XImage* ximage = capture_rect(ctx, area.x * scale, area.y * scale
+                                  , area.width * scale, area.height * scale);
+    if (NULL == ximage) {
+        return false;
     }
+    char* pixels = ximage->data;
+    int stride = ximage->bytes_per_line;
+    if (scale > 1) {
+        int bpp = ctx->fb.bpp;
+        if (!reserve_buffer(&ctx->scaled, &ctx->scaled_size, area.width * area.height * bpp)) {
+            return false;
+        }
+        downscale(pixels, stride, ctx->scaled, area.width * bpp
+                  , area.width, area.height, scale, bpp);
+        pixels = ctx->scaled;
+        stride = area.width * bpp;
+    }
+    x = area.x;
+    y = area.y;
+    width = area.width;
+    height = area.height;
+    // scrolled pixels move on the client first, fb_update sends the rest
+    bool res = motion_copy(ctx, pixels, stride, x, y, width, height);
+    int cnt = fb_update(&ctx->fb, pixels, stride, x, y, width, height);
+    for (int i = 0; i < cnt; i += 1) {
+        XRectangle* r = &ctx->fb.changed[i];
+        res = pipeline_submit_image(ctx, r->x, r->y, r->width, r->height) && res;
+        if (ctx->pl.coarse) {
+            // the client gets something close, the real pixels follow later
+            fb_invalidate_rect(&ctx->fb, r->x, r->y, r->width, r->height);
+            damage_requeue(&ctx->refine, r->x * scale, r->y * scale
+                           , r->width * scale, r->height * scale);
+        }
+    }
+    return res;
 }
 
-bool dummy_pointer_writer(struct context* ctx, int x, int y
-                          , int width, int height, char* pointer) {
-    return true;
+static int cursor_png(struct context* ctx, const char* rgba, int width, int height) {
+    int size = width * height * 4 + 1024;
+    if (!reserve_buffer(&ctx->cursor_buf, &ctx->cursor_buf_size, size)) {
+        return 0;
+    }
+    return png_encode(&ctx->cursor_png, ctx->cfg.png_level, ctx->cfg.png_filter
+                      , ctx->cursor_buf, size, rgba, width * 4, width, height, rgba_row_copy, 4);
 }
 
-static bool output_damage(struct context* ctx, int x, int y, int width, int height) {
-//    slog(LOG_DEBUG, "outputing damage: %d %d %d %d\n", x, y, width, height);
+// A PF_CACHE client that has the shape already gets its slot number,
+// a known serial doesn't even make us fetch the image from X.
+static bool output_pointer_image(struct context* ctx, unsigned long serial) {
+    struct pointer_msg pm;
+    XFixesCursorImage* cursor;
+    char* data;
+    char* payload;
+    bool fresh = true;
     bool res;
-    char* buf = image_buffer + DATA_BUFFER_HEAD;
-    int len = ctx->get_image(ctx, buf, x, y, width, height);
-    res = len > 0 && ctx->write_image(ctx, x, y, width, height, buf, len);
+    memset(&pm, 0, sizeof(pm));
+    if (ctx->pointer_format & PF_CACHE) {
+        pm.slot = cursor_cache_find(&ctx->cursors, serial);
+        if (pm.slot >= 0) {
+            pm.kind = PointerCached;
+            pm.x = ctx->cursor_x / ctx->scale;
+            pm.y = ctx->cursor_y / ctx->scale;
+            return pipeline_submit_pointer(ctx, &pm, NULL);
+        }
+    }
+    cursor = XFixesGetCursorImage(ctx->display);
+    if (NULL == cursor) {
+        return false;
+    }
+    data = malloc(cursor->width * cursor->height * 4);
+    if (NULL == data) {
+        slog(LOG_ERR, "Cannot allocate %dx%d pointer image", cursor->width, cursor->height);
+        XFree(cursor);
+        return false;
+    }
+    cursor_to_rgba(cursor->pixels, data, cursor->width * cursor->height);
+    payload = data;
+    pm.kind = PointerImage;
+    pm.x = cursor->x / ctx->scale;
+    pm.y = cursor->y / ctx->scale;
+    pm.width = cursor->width;
+    pm.height = cursor->height;
+    pm.len = cursor->width * cursor->height * 4;
+    if (ctx->pointer_format & PF_CACHE) {
+        pm.slot = cursor_cache_put(&ctx->cursors, cursor->cursor_serial
+                                   , cursor_hash(data, pm.width, pm.height), &fresh);
+        pm.kind = PointerDefine;
+    }
+    if (!fresh) {
+        pm.kind = PointerCached;
+        pm.len = 0;
+    } else if (ctx->pointer_format & PF_PNG) {
+        pm.kind = PointerDefine;
+        pm.len = cursor_png(ctx, data, pm.width, pm.height);
+        payload = ctx->cursor_buf;
+    }
+    res = (pm.len > 0 || !fresh) && pipeline_submit_pointer(ctx, &pm, payload);
+    if (!res && fresh && (ctx->pointer_format & PF_CACHE)) {
+        ctx->cursors.slots[pm.slot].hash = 0; // the client never got it
+    }
+    free(data);
+    XFree(cursor);
     return res;
 }
 
-static bool output_pointer_image(struct context* ctx) {
-    XFixesCursorImage* cursor = XFixesGetCursorImage(ctx->display);
-    char* data = image_buffer + POINTERCMD_HEAD_LEN; // leave some head space for cmd header
-    cursor2rgba(cursor->pixels, data, cursor->width * cursor->height * 4);
-    return ctx->write_pointer(ctx, cursor->x, cursor->y
-                       , cursor->width, cursor->height, data);
+static bool output_pointer_coords(struct context* ctx, int x, int y) {
+    struct pointer_msg pm;
+    memset(&pm, 0, sizeof(pm));
+    pm.kind = PointerMove;
+    pm.x = x / ctx->scale;
+    pm.y = y / ctx->scale;
+    return pipeline_submit_pointer(ctx, &pm, NULL);
 }
 
-static bool output_pointer_coords(struct context* ctx, int x, int y) {
-    return ctx->write_pointer(ctx, x, y, 0, 0, image_buffer);
+// XI 2.1 and later deliver raw events to the root window even while
+// somebody holds a grab, so a drag doesn't freeze the pointer
+static void select_raw_motion(struct context* ctx, Display* display, Window root) {
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)];
+    XIEventMask mask;
+    int major = 2;
+    int minor = 2;
+    int t;
+    if (!XQueryExtension(display, "XInputExtension", &ctx->xi_opcode, &t, &t)
+        || XIQueryVersion(display, &major, &minor) != Success) {
+        slog(LOG_WARNING, "no XInput2, polling the pointer every %d ms"
+             , POINTER_CHECK_INTERVAL_MSEC);
+        ctx->xi_opcode = -1;
+        return;
+    }
+    memset(bits, 0, sizeof(bits));
+    XISetMask(bits, XI_RawMotion);
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(bits);
+    mask.mask = bits;
+    XISelectEvents(display, root, &mask, 1);
 }
 
 static bool setup_display(const char * display_name, struct context* ctx) {
@@ -162,39 +245,37 @@ static bool setup_display(const char * display_name, struct context* ctx) {
     XFixesSelectCursorInput(display, root,
                             XFixesDisplayCursorNotifyMask);
     XDamageCreate(display, root, XDamageReportRawRectangles);
+    select_raw_motion(ctx, display, root);
     ctx->cursor_x = 0;
     ctx->cursor_y = 0;
+    ctx->pointer_moved = true;
+    ctx->pointer_at = 0;
     
     ctx->display = display;
     ctx->root = root;
     return true;
 }
 
-static int get_image_bmp(struct context* ctx, char* out, int x, int y, int width, int height) {
-    XImage* ximage = ctx->p.bmp.shmimage;
-    ximage->width = width;
-    ximage->height = height;
-    if (!XShmGetImage(ctx->display, ctx->root
-                      , ximage, x, y, AllPlanes)) {
-        slog(LOG_ERR, "unabled to get the image\n");
-        return 0;
-    }
-    for (int j = 0; j < height; j += 1) {
-        for (int i = 0; i < width; i += 1) {
-            unsigned long pixel = XGetPixel(ximage, i, j);
-            out[0] = pixel & 0xFF;
-            out[1] = (pixel >> 16) & 0xFF;
-            out[2] = (pixel >> 8) & 0xFF;
-            out += 3;
-        }
+// the fb, and so the client, gets the root shrunk by scale
+static bool init_fb(struct context* ctx, int width, int height, int scale) {
+    int bpp = ctx->p.bmp.shmimage->bits_per_pixel / 8;
+    if (scale > 1 && bpp < 3) {
+        slog(LOG_NOTICE, "cannot downscale %d bpp, sending the full size", bpp * 8);
+        scale = 1;
     }
-    return width * height * 3;
+    ctx->scale = scale;
+    return fb_init(&ctx->fb, width / scale, height / scale, bpp);
 }
 
-static bool init_image_pump_bmp(struct context* ctx, int width, int height) {
+// shared memory the server puts captured rects into; reused on reinit
+static bool init_capture(struct context* ctx, int width, int height, int scale) {
     int scr = XDefaultScreen(ctx->display);
     XShmSegmentInfo* shminfo = &ctx->p.bmp.shminfo;
-    XImage* shmimage = XShmCreateImage(
+    XImage* shmimage = ctx->p.bmp.shmimage;
+    if (shmimage != NULL) {
+        return init_fb(ctx, width, height, scale);
+    }
+    shmimage = XShmCreateImage(
         ctx->display, DefaultVisual(ctx->display, scr), DefaultDepth(ctx->display, scr)
         , ZPixmap, NULL, shminfo, width, height);
 
@@ -214,88 +295,8 @@ static bool init_image_pump_bmp(struct context* ctx, int width, int height) {
         slog(LOG_ERR, "Failed to attach shared memory!");
         return false;
     }
-    ctx->p.bmp.shmimage = shmimage;
-    image_buffer = malloc(IMAGECMD_HEAD_LEN + width * height * 3);
-    ctx->get_image = get_image_bmp;
-    return true;
-}
-
-static cairo_status_t write_png(void* closure, const unsigned char* data, unsigned int length) {
-    struct png_wr_ctx* wr_ctx = (struct png_wr_ctx*)closure;
-    memcpy(wr_ctx->out + wr_ctx->offset, data, length);
-    wr_ctx->offset += length;
-    return CAIRO_STATUS_SUCCESS;
-}
-
-static int get_image_png(struct context* ctx, char* out, int x, int y, int width, int height) {
-    cairo_surface_t* xsurface;
-    cairo_surface_t* isurface;
-    cairo_rectangle_int_t rect;
-    struct png_wr_ctx wr_ctx;
-    wr_ctx.out = out;
-    wr_ctx.offset = 0;
-    rect.x = x;
-    rect.y = y;
-    rect.width = width;
-    rect.height = height;
-    xsurface = cairo_xlib_surface_create(
-        ctx->display, ctx->root, XDefaultVisual(ctx->display, XDefaultScreen(ctx->display))
-        , x + width, y + height);
-    isurface = cairo_surface_map_to_image(xsurface, &rect);
-    cairo_surface_write_to_png_stream(isurface, write_png, &wr_ctx);
-    cairo_surface_unmap_image(xsurface, isurface);
-    cairo_surface_destroy(xsurface);
-    return wr_ctx.offset;
-}
-
-static bool init_image_pump_png(struct context* ctx, int width, int height) {
-    image_buffer = malloc(IMAGECMD_HEAD_LEN + width * height * 3);
-    ctx->get_image = get_image_png;
-    return true;
-}
-
-static int get_image_webp(struct context* ctx, char* out, int x, int y, int width, int height) {
-    XImage* ximage = ctx->p.bmp.shmimage;
-    ximage->width = width;
-    ximage->height = height;
-    if (!XShmGetImage(ctx->display, ctx->root
-                      , ximage, x, y, AllPlanes)) {
-        slog(LOG_ERR, "unabled to get the image\n");
-        return 0;
-    }
-    WebPPicture* pic = &ctx->p.webp.picture;
-    pic->argb = (uint32_t*)ximage->data;
-    pic->argb_stride = width;
-    WebPMemoryWriter w;
-    w.mem = out;
-    w.max_size = width * height * 3;
-    w.size = 0;
-    pic->custom_ptr = &w;
-    WebPEncode(&ctx->p.webp.config, pic);
-    return w.size;
-}
-
-static bool init_image_pump_webp(struct context* ctx, int width, int height) {
-    init_image_pump_bmp(ctx, width, height);
-    ctx->get_image = get_image_webp;
-    WebPConfig config;
-    if (!WebPConfigPreset(&ctx->p.webp.config, WEBP_PRESET_PHOTO, 100)
-        || !WebPConfigLosslessPreset(&ctx->p.webp.config, 3))
-    {
-        return false;
-    }
-    WebPPicture* pic = &ctx->p.webp.picture;
-    if (!WebPPictureInit(pic)) {
-        return 0;
-    }
-    pic->width = width;
-    pic->height = height;
-    if (!WebPPictureAlloc(pic)) {
-        return 0;
-    }
-    pic->writer = WebPMemoryWrite;
-
-    return true;
+    encoder_visual(ctx, shmimage);
+    return init_fb(ctx, width, height, scale);
 }
 
 static void daemonize() {
@@ -312,6 +313,21 @@ static void send_error_reply(struct context* ctx, enum CommandResultCode error)
     ctx->send_reply(ctx, buf, 2);
 }
 
+// largest whole factor that still leaves at least the panel size asked for
+static int pick_scale(int width, int height, const char* buf) {
+    int target_w = ntohl(((const int*)(buf + 4))[0]);
+    int target_h = ntohl(((const int*)(buf + 4))[1]);
+    int scale = 1;
+    if (target_w <= 0 || target_h <= 0) {
+        return 1;
+    }
+    while (scale < MAX_SCALE && width / (scale + 1) >= target_w
+           && height / (scale + 1) >= target_h) {
+        scale += 1;
+    }
+    return scale;
+}
+
 static bool init_cmd_reply(struct context* ctx, char* buf) {
     if (buf[0] != 0) {
         send_error_reply(ctx, ErrorBadMessage);
@@ -323,106 +339,311 @@ static bool init_cmd_reply(struct context* ctx, char* buf) {
         return false;
     }
     
+    // encoded once for everybody, so a viewer joining others has to take
+    // what they already get
+    if (ctx->out_peers != NULL && ctx->out_peers(ctx) > 0) {
+        if ((buf[2] & ctx->screen_format) != ctx->screen_format) {
+            send_error_reply(ctx, ErrorScreenFormatNotSupported);
+            return false;
+        }
+        if ((buf[3] & ctx->pointer_format) != ctx->pointer_format) {
+            send_error_reply(ctx, ErrorPointerFormatNotSupported);
+            return false;
+        }
+        buf[2] = ctx->screen_format;
+        buf[3] = ctx->pointer_format;
+    }
+
     XWindowAttributes attrib;
     XGetWindowAttributes(ctx->display, ctx->root, &attrib);
-    bool init_res;
-    if ((buf[2] & SF_PNG) != 0) {
-#ifdef USE_PNG
-        init_res = init_image_pump_png(ctx, attrib.width, attrib.height);
-#else
-        init_res = init_image_pump_webp(ctx, attrib.width, attrib.height);
-#endif
-        buf[2] = SF_PNG; // android automatically detect png/webp/jpeg formats on decoding
-    } else if ((buf[2] & SF_RGB) != 0) {
-        init_res = init_image_pump_bmp(ctx, attrib.width, attrib.height);
-        buf[2] = SF_RGB;
-    } else {
+    int scale = buf[1] >= 2 ? pick_scale(attrib.width, attrib.height, buf) : 1;
+    if (ctx->out_peers != NULL && ctx->out_peers(ctx) > 0) {
+        scale = ctx->scale;
+    }
+    // smallest encoding the client can take
+    int format = encoder_format((uint8_t)buf[2]);
+    if (0 == format) {
         send_error_reply(ctx, ErrorScreenFormatNotSupported);
         return false;
     }
-
-    if (! init_res) {
+    if (!init_capture(ctx, attrib.width, attrib.height, scale) || !init_encoder(ctx, format)) {
         send_error_reply(ctx, ErrorInitFailed);
         return false;
     }
+    // CopyRect and FillRect come on top of whichever codec
+    buf[2] = format | (buf[2] & SF_PRIMITIVES);
 
-    if ((buf[3] & PF_RGBA) == 0) {
+    // PNG over RGBA, the cache on top of either
+    int pointer = buf[3] & PF_PNG ? PF_PNG : buf[3] & PF_RGBA;
+    if (0 == pointer) {
         send_error_reply(ctx, ErrorPointerFormatNotSupported);
         return false;
     }
+    pointer |= buf[3] & PF_CACHE;
+    ctx->screen_format = (uint8_t)buf[2]; // SF_RGB565 is the sign bit
+    ctx->pointer_format = pointer;
+    // every viewer starts over with an empty cache and the whole screen in view
+    cursor_cache_reset(&ctx->cursors);
+    ctx->view.r.width = 0;
+    ctx->view.r.height = 0;
+    ctx->view.gaze_x = -1;
+    ctx->view.gaze_y = -1;
+    damage_clear(&ctx->background);
+    damage_clear(&ctx->refine);
     buf[0] = InitReply;
     buf[1] = ResultSuccess;
-    buf[2] = SF_PNG;
-    buf[3] = PF_RGBA;
-    ((int*)(buf + 4))[0] = htonl(attrib.width);
-    ((int*)(buf + 4))[1] = htonl(attrib.height);
-    return ctx->send_reply(ctx, buf, 12);
+    buf[3] = pointer;
+    ((int*)(buf + 4))[0] = htonl(ctx->fb.width);
+    ((int*)(buf + 4))[1] = htonl(ctx->fb.height);
+    if (!ctx->send_reply(ctx, buf, 12)) {
+        return false;
+    }
+    // the client starts from scratch, so does our framebuffer
+    damage_add(&ctx->damage, 0, 0, attrib.width, attrib.height);
+    return true;
 }
 
 static bool handshake(struct context* ctx) {
-    char buf[MAX_INIT_BUF_SIZE];
+    char buf[MAX(MAX_INIT_BUF_SIZE, MAX_COMMAND_LEN)];
 
-    if (! ctx->init_conn(ctx, buf, INIT_CMD_LEN)) {
+    if (! ctx->init_conn(ctx, buf, sizeof(buf))) {
         return false;
     }
     return init_cmd_reply(ctx, buf);
 }
 
-static void update_fail_cnt(bool res, int* fail) {
-    if (res) {
-        *fail = 0;
+static bool damage_due(struct context* ctx, unsigned long millis, unsigned long flushmillis) {
+    return !damage_empty(&ctx->damage) && millis - flushmillis >= ctx->frame_interval;
+}
+
+// Latest wins: while encoders or the link are behind, damage keeps
+// piling up (and merging) in ctx->damage and is captured only once there
+// is room again, so whatever goes out is the newest picture.
+static bool output_busy(struct context* ctx) {
+    long backlog = (long)ctx->cfg.backlog_kb * 1024;
+    if (ctx->pl.tail - ctx->pl.head > PIPELINE_DEPTH / 2) {
+        return true;
+    }
+    return backlog > 0 && ctx->out_queued != NULL && ctx->out_queued(ctx) > backlog;
+}
+
+// nothing encoded or queued, the link has room for refinements
+static bool link_idle(struct context* ctx) {
+    return ctx->pl.head == ctx->pl.tail && (NULL == ctx->out_queued || 0 == ctx->out_queued(ctx));
+}
+
+static bool background_due(struct context* ctx, unsigned long millis, unsigned long bgmillis) {
+    return !damage_empty(&ctx->background)
+        && (millis - bgmillis >= ctx->cfg.background_ms || link_idle(ctx));
+}
+
+static bool refine_due(struct context* ctx) {
+    return !damage_empty(&ctx->refine) && damage_empty(&ctx->damage)
+        && damage_empty(&ctx->background) && link_idle(ctx);
+}
+
+static unsigned long earliest(unsigned long deadline, unsigned long other) {
+    return 0 == deadline ? other : MIN(deadline, other);
+}
+
+static void add_damage(struct context* ctx, const XRectangle* r) {
+    if (ctx->view.r.width > 0) {
+        damage_add_split(&ctx->damage, &ctx->background, &ctx->view.r
+                         , r->x, r->y, r->width, r->height);
     } else {
-        *fail += 1;
+        damage_add(&ctx->damage, r->x, r->y, r->width, r->height);
+    }
+}
+
+// what's nearest to where the user looks goes out first
+static void flush_damage(struct context* ctx, struct damage_region* dmg, bool coarse) {
+    bool gaze = ctx->view.gaze_x >= 0 && ctx->view.gaze_y >= 0;
+    damage_sort(dmg, gaze ? ctx->view.gaze_x : ctx->cursor_x
+                , gaze ? ctx->view.gaze_y : ctx->cursor_y);
+    for (int i = 0; i < dmg->cnt; i += 1) {
+        XRectangle* r = &dmg->rects[i];
+        pipeline_begin_capture(ctx, dmg->since, coarse);
+        update_fail_cnt(ctx, output_damage(ctx, r->x, r->y, r->width, r->height));
+    }
+    damage_clear(dmg);
+}
+
+// Damage in view goes out every frame at full quality. The rest waits
+// for background_ms or an idle link and, if the client takes WebP, goes
+// out at background_quality to be refined once the link is idle again.
+// The client talks fb pixels, damage is kept in root window ones.
+static void set_viewport(struct context* ctx, const char* buf) {
+    const int* field = (const int*)(buf + 1);
+    struct viewport* v = &ctx->view;
+    int scale = ctx->scale;
+    int width = ctx->fb.width * scale;
+    int height = ctx->fb.height * scale;
+    int x = MAX(0, MIN((int)ntohl(field[0]) * scale, width));
+    int y = MAX(0, MIN((int)ntohl(field[1]) * scale, height));
+    XRectangle screen = {0, 0, width, height};
+    v->r.x = x;
+    v->r.y = y;
+    v->r.width = MAX(0, MIN((int)ntohl(field[2]) * scale, width - x));
+    v->r.height = MAX(0, MIN((int)ntohl(field[3]) * scale, height - y));
+    v->gaze_x = (int)ntohl(field[4]) < 0 ? -1 : (int)ntohl(field[4]) * scale;
+    v->gaze_y = (int)ntohl(field[5]) < 0 ? -1 : (int)ntohl(field[5]) * scale;
+    if (0 == v->r.width || 0 == v->r.height) {
+        v->r.width = 0;
+        v->r.height = 0;
+        damage_move(&ctx->background, &ctx->damage, &ctx->damage, &screen);
+        return;
+    }
+    // what waits may be in view now, coarse pixels in view are refined right away
+    damage_move(&ctx->background, &ctx->damage, &ctx->background, &v->r);
+    damage_move(&ctx->refine, &ctx->damage, &ctx->refine, &v->r);
+}
+
+static void handle_command(struct context* ctx, char* buf, int len) {
+    switch (buf[0]) {
+    case Init:
+        slog(LOG_WARNING, "Remote side initiated reinit. Replying...\n");
+        pipeline_discard(ctx);
+        if (init_cmd_reply(ctx, buf)) {
+            output_pointer_image(ctx, 0);
+        }
+        break;
+    case Viewport:
+        set_viewport(ctx, buf);
+        break;
+    default:
+        slog(LOG_DEBUG, "client command %d ignored", buf[0]);
+        break;
+    }
+}
+
+static void sample_pointer(struct context* ctx) {
+    int junk, x, y;
+    Window junkw;
+    XQueryPointer(ctx->display, ctx->root, &junkw, &junkw
+                  , &x, &y, &junk, &junk, &junk);
+    if (x != ctx->cursor_x || y != ctx->cursor_y) {
+        update_fail_cnt(ctx, output_pointer_coords(ctx, x, y));
+        ctx->cursor_x = x;
+        ctx->cursor_y = y;
+    }
+}
+
+// Raw motion only tells that the pointer moved, where to takes an
+// XQueryPointer. A burst of motion is merged into at most pointer_hz
+// queries a second and a still pointer costs nothing.
+static void update_pointer(struct context* ctx, unsigned long millis) {
+    unsigned long interval = 1000 / ctx->cfg.pointer_hz;
+    if (ctx->xi_opcode < 0) {
+        interval = MAX(interval, POINTER_CHECK_INTERVAL_MSEC);
+        ctx->pointer_moved = true;
+    }
+    if (!ctx->pointer_moved) {
+        return;
     }
+    if (millis - ctx->pointer_at < interval) {
+        loop_set_pointer(&ctx->loop, ctx->pointer_at + interval);
+        return;
+    }
+    sample_pointer(ctx);
+    ctx->pointer_at = millis;
+    ctx->pointer_moved = false;
+    loop_set_pointer(&ctx->loop, ctx->xi_opcode < 0 ? millis + interval : 0);
 }
 
 static void pump(struct context* ctx) {
-    unsigned long oldmillis = 0;
-    int oldx = 0;
-    int oldy = 0;
-    int fail_cnt = 0;
+    unsigned long flushmillis = 0;
+    unsigned long bgmillis = 0;
     unsigned long fps_startmillis = now();
     int frame_cnt = 0;
-    while (!ctx->fin && fail_cnt < FAILURES_EXIT_PUMP) {
-        struct timespec tp;
+    char buf[MAX(MAX_INIT_BUF_SIZE, MAX_COMMAND_LEN)];
+    ctx->fail_cnt = 0;
+    while (!ctx->fin && ctx->fail_cnt < FAILURES_EXIT_PUMP) {
+        unsigned events = loop_wait(ctx, &ctx->loop);
         unsigned long millis = now();
-        if (millis - oldmillis > POINTER_CHECK_INTERVAL_MSEC) {
-            int junk, x, y;
-            Window junkw;
-            XQueryPointer(ctx->display, ctx->root, &junkw, &junkw
-                          , &x, &y, &junk, &junk, &junk);
-            if (x != oldx || y != oldy) {
-                update_fail_cnt(output_pointer_coords(ctx, x, y), &fail_cnt);
-                oldx = x;
-                oldy = y;
-            }
-            oldmillis = millis;
+        int len;
+        if (events & LoopSignal) {
+            ctx->fin = 1;
+            break;
+        }
+        if (events & LoopDump) {
+            trace_dump(&ctx->trace);
         }
-        while (XPending(ctx->display) > 0 && millis - oldmillis < POINTER_CHECK_INTERVAL_MSEC) {
+        if (events & LoopTransport) {
+            update_fail_cnt(ctx, ctx->flush_out(ctx));
+        }
+        while (XPending(ctx->display) > 0) {
             XEvent event;
             XNextEvent(ctx->display, &event);
             if (ctx->cursor_evt_base + XFixesCursorNotify == event.type) {
-                update_fail_cnt(output_pointer_image(ctx), &fail_cnt);
+                XFixesCursorNotifyEvent* ce = (XFixesCursorNotifyEvent*)&event;
+                update_fail_cnt(ctx, output_pointer_image(ctx, ce->cursor_serial));
             } else if (ctx->damage_evt_base + XDamageNotify == event.type) {
                 XDamageNotifyEvent* de = (XDamageNotifyEvent*) &event;
                 if (de->drawable == ctx->root) {
-                    update_fail_cnt(output_damage(ctx, de->area.x, de->area.y
-                                                  , de->area.width, de->area.height), &fail_cnt);
-                    frame_cnt += 1;
-                    if (millis - fps_startmillis > FPS_LOG_INTERVAL_MSEC) {
-                        slog(LOG_INFO, "%d fps\n", frame_cnt / ((millis - fps_startmillis) / 1000));
-                        fps_startmillis = millis;
-                        frame_cnt = 0;
-                    }
+                    add_damage(ctx, &de->area);
                 }
+            } else if (GenericEvent == event.type && event.xcookie.extension == ctx->xi_opcode) {
+                ctx->pointer_moved = true; // XI_RawMotion, nothing else is selected
             }
             millis = now();
+            // whatever Xlib has already read belongs to this frame, but
+            // don't go back to the server once the frame is due
+            if (damage_due(ctx, millis, flushmillis)
+                && XEventsQueued(ctx->display, QueuedAlready) == 0) {
+                break;
+            }
+        }
+        update_pointer(ctx, millis);
+        if (damage_due(ctx, millis, flushmillis) && !output_busy(ctx)) {
+            flush_damage(ctx, &ctx->damage, false);
+            flushmillis = millis;
+            frame_cnt += 1;
+            if (millis - fps_startmillis > FPS_LOG_INTERVAL_MSEC) {
+                slog(LOG_INFO, "%lu fps\n", frame_cnt * 1000UL / (millis - fps_startmillis));
+                slog(LOG_INFO, "%lu of %lu damaged bytes unchanged\n"
+                     , ctx->fb.dropped_bytes, ctx->fb.damaged_bytes);
+                slog(LOG_INFO, "%lu jobs, %ld bytes queued, %lu updates superseded\n"
+                     , ctx->pl.tail - ctx->pl.head
+                     , ctx->out_queued ? ctx->out_queued(ctx) : 0L, ctx->damage.superseded);
+                trace_log(&ctx->trace);
+                ctx->damage.superseded = 0;
+                ctx->fb.dropped_bytes = 0;
+                ctx->fb.damaged_bytes = 0;
+                fps_startmillis = millis;
+                frame_cnt = 0;
+            }
+        }
+        if (background_due(ctx, millis, bgmillis) && !output_busy(ctx)) {
+            flush_damage(ctx, &ctx->background, (ctx->screen_format & SF_WEBP) != 0);
+            bgmillis = millis;
         }
-        if (ctx->check_reinit(ctx, image_buffer, INIT_CMD_LEN)) {
-            slog(LOG_WARNING, "Remote side initiated reinit. Replying...\n");
-            init_cmd_reply(ctx, image_buffer);
+        if (refine_due(ctx)) {
+            flush_damage(ctx, &ctx->refine, false);
         }
+        pipeline_send_ready(ctx);
+        trace_transport(ctx);
+        stats_gauges(ctx);
+        while ((len = ctx->read_command(ctx, buf, sizeof(buf))) > 0) {
+            handle_command(ctx, buf, len);
+        }
+        // a busy link or encoder wakes us up through its fd when it's done,
+        // refinements wait for one that's idle
+        unsigned long deadline = 0;
+        if (!output_busy(ctx)) {
+            if (!damage_empty(&ctx->damage)) {
+                deadline = flushmillis + ctx->frame_interval;
+            }
+            if (!damage_empty(&ctx->background)) {
+                deadline = earliest(deadline, bgmillis + ctx->cfg.background_ms);
+            }
+            if (!damage_empty(&ctx->refine)) {
+                deadline = earliest(deadline, millis + ctx->frame_interval);
+            }
+        }
+        loop_set_frame(&ctx->loop, deadline);
     }
+    pipeline_stop(ctx);
+    trace_transport(ctx);
     ctx->fin = 0;
 }
 
@@ -439,24 +660,59 @@ static int check_len_or_die(char* value, char* field_name) {
 
 static struct context context;
 
-
 int main(int argc, char* argv[]) {
     char* disp_name = ":0";
     char* path;
+    char* trace_path = NULL;
+    char* stats_path = NULL;
     int c;
     int debug = 0;
     int len;
     long int port;
     int i;
     int handshake_attempts = 2;
-
+    long int fps;
+    long int workers = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_ENCODER_THREADS);
+
+    context.frame_interval = 1000 / DEFAULT_FPS;
+    config_defaults(&context.cfg);
+    damage_init(&context.damage, DAMAGE_RECT_COST);
+    damage_init(&context.background, DAMAGE_RECT_COST);
+    damage_init(&context.refine, DAMAGE_RECT_COST);
+    context.view.gaze_x = -1;
+    context.view.gaze_y = -1;
+    context.scale = 1;
     openlog(PROG, LOG_PERROR | LOG_CONS | LOG_PID, LOG_DAEMON);
-    while ((c = getopt (argc, argv, "hdu:D:l:p:")) != -1) {
+    loop_block_signals();
+    while ((c = getopt (argc, argv, "hdf:j:m:o:u:D:l:p:r:s:t:")) != -1) {
         switch (c)
         {
         case 'd':
             debug = 1;
             break;
+        case 'f':
+            fps = strtol(optarg, NULL, 10);
+            if (fps < 1 || fps > 1000) {
+                fprintf(stderr, "Frame rate %s is not in range."
+                        " Will use default %d fps\n", optarg, DEFAULT_FPS);
+                fps = DEFAULT_FPS;
+            }
+            context.frame_interval = 1000 / fps;
+            break;
+        case 'o':
+            if (!config_set(&context.cfg, optarg)) {
+                fprintf(stderr, "Bad option %s. Exiting...\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            workers = strtol(optarg, NULL, 10);
+            if (workers < 0 || workers > MAX_ENCODER_THREADS) {
+                fprintf(stderr, "Encoder thread count %s is not in range 0..%d."
+                        " Will encode on the capture thread\n", optarg, MAX_ENCODER_THREADS);
+                workers = 0;
+            }
+            break;
         case 'D':
             len = check_len_or_die(optarg, "Display name");
             disp_name = malloc(len + 1);
@@ -477,6 +733,22 @@ int main(int argc, char* argv[]) {
             strncpy(path, optarg, len + 1);
             init_ppm(&context, path);
             break;
+        case 'r':
+            check_len_or_die(optarg, "File name");
+            init_rec(&context, optarg);
+            break;
+        case 't':
+            check_len_or_die(optarg, "Trace file");
+            trace_path = optarg;
+            break;
+        case 'm':
+            check_len_or_die(optarg, "Stats socket path");
+            stats_path = optarg;
+            break;
+        case 's':
+            check_len_or_die(optarg, "Socket path");
+            init_shm(&context, optarg);
+            break;
 #if WITH_USB
         case 'u':
             check_len_or_die(optarg, "USB device");
@@ -501,11 +773,16 @@ int main(int argc, char* argv[]) {
     }
     
     if (debug) {
-        log_level = LOG_DEBUG;
+        set_log_level(LOG_DEBUG);
     } else {
         daemonize();
     }
-    if (!setup_display(disp_name, &context)) {
+    if (!setup_display(disp_name, &context)
+        || !loop_init(&context.loop, ConnectionNumber(context.display))
+        || !trace_init(&context.trace, trace_path)
+        || !stats_init(stats_path)
+        || !pipeline_init(&context, workers)
+        || !loop_watch_done(&context.loop, context.pl.done_fd)) {
         exit(1);
     }
     slog(LOG_NOTICE, "%s up and running", PROG);
@@ -519,7 +796,11 @@ int main(int argc, char* argv[]) {
         exit(0);
     }
     slog(LOG_INFO, "handshake success");
-    output_pointer_image(&context);
+    output_pointer_image(&context, 0);
     pump(&context);
+    if (context.close_out) {
+        context.close_out(&context);
+    }
+    trace_dump(&context.trace);
 }
 
@@ -21,17 +21,50 @@
 #define __X_VIREDERO_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
 #include <X11/Xlibint.h>
 #include <X11/extensions/XShm.h>
-#include <cairo/cairo.h>
+#include <zlib.h>
 #include <webp/encode.h>
 #if WITH_USB
 #include <libusb-1.0/libusb.h>
 #endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #define IMAGECMD_HEAD_LEN 21
-#define POINTERCMD_HEAD_LEN 18
+#define POINTERCMD_HEAD_LEN 26 // longest, PointerDefine
+#define PRIMCMD_HEAD_LEN 25 // longest, CopyRect
+#define POINTER_CACHE_SLOTS 32 // shapes a PF_CACHE client keeps
+#define MAX_INIT_BUF_SIZE 12 // maximum size required for init_reply cmd
 #define DEFAULT_PORT 1242
+#define DATA_BUFFER_HEAD 32 // room for command header in front of payload
+#define PIPELINE_DEPTH 32
+#define DAMAGE_MAX_RECTS 64
+#define FB_TILE_SIZE 64
+#define USB_OUT_XFERS 3
+#define MAX_COMMAND_LEN 32 // client to server
+#define INIT_CMD_LEN 4
+#define INIT_V2_CMD_LEN 12 // version 2 adds the panel size the client wants
+#define VIEWPORT_CMD_LEN 25
+#define LOOP_MAX_TRANSPORT_FDS 64
+#define SOCK_MAX_CLIENTS 16
+#define SHM_RING_MAGIC 0x52445256 // "VRDR"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEAD_SIZE 4096 // page, data follows
+#define TRACE_HIST_SUB_BITS 4 // 16 buckets per power of two, ~6% resolution
+#define TRACE_HIST_BUCKETS ((64 - TRACE_HIST_SUB_BITS + 1) << TRACE_HIST_SUB_BITS)
+#define TRACE_RING_SIZE 8192 // messages kept for the trace dump
+#define STATS_MAX_THREADS 64 // own counter blocks, later threads share one
+#define IMAGE_CODECS 7 // entries in ImageCodec
+#define DELTA_XOR 0x80 // SF_DELTA payload is XORed onto the picture, else replaces it
+#define REC_MAGIC "VRDREC\0\1"
+#define REC_VERSION 1
+#define REC_HEAD_SIZE 64 // first record starts here
 
 enum CommandType {
     Init,
@@ -40,6 +73,9 @@ enum CommandType {
     Pointer,
     SceneChange,
     ReCenter,
+    CopyRect, // SF_PRIMITIVES sessions only
+    FillRect,
+    Viewport, // client to server: x, y, width, height, gaze x, y
 };
 
 enum CommandResultCode {
@@ -54,11 +90,86 @@ enum CommandResultCode {
 enum ScreenFormat { // bit masks
     SF_RGB = 0x1,
     SF_PNG = 0x2,
+    SF_WEBP = 0x4,
+    SF_MIXED = 0x8, // codec picked per rect from the other bits offered
+    SF_DELTA = 0x10, // wire RGB, XORed with what the client has, compressed
+    SF_PRIMITIVES = 0x20, // CopyRect and FillRect besides Image, with any of the above
+    SF_YUV420 = 0x40, // planes Y, U, V, chroma per 2x2 block, BT.601 video range
+    SF_RGB565 = 0x80, // little endian, ordered dither unless -o dither=off
+};
+
+enum ImageCodec { // first payload byte of every Image in SF_MIXED sessions
+    CodecRgb,
+    CodecPng,
+    CodecWebpLossless,
+    CodecWebpLossy,
+    CodecDelta, // SF_DELTA sessions only
+    CodecYuv420, // SF_YUV420 sessions only
+    CodecRgb565, // SF_RGB565 sessions only
+};
+
+// First byte of an SF_DELTA Image, maybe with DELTA_XOR. The compressed
+// data is width * height wire RGB.
+enum DeltaCompression {
+    DeltaLz4,
+    DeltaZstd,
+};
+
+enum Dither { // SF_RGB565
+    DitherOff,
+    DitherBayer, // 4x4, pinned to the screen so rects match up
 };
 
 enum PointerFormat { //bit masks
     PF_RGBA = 0x1,
     PF_PNG = 0x2,
+    PF_CACHE = 0x4, // client keeps POINTER_CACHE_SLOTS shapes by slot number
+};
+
+// Byte 9 of a Pointer message, after type and x, y. PointerImage is all
+// a PF_RGBA only client ever gets. With PF_PNG or PF_CACHE shapes come as
+// PointerDefine with a PNG (PF_PNG) or RGBA payload and replace the shape
+// in their slot, PointerCached shows a shape defined earlier. The cache
+// is empty after every InitReply.
+enum PointerKind {
+    PointerMove, // nothing follows
+    PointerImage, // width, height, width * height RGBA
+    PointerDefine, // width, height, slot, payload length, payload
+    PointerCached, // slot
+};
+
+struct pointer_msg {
+    enum PointerKind kind;
+    int x;
+    int y;
+    int width;
+    int height;
+    int slot;
+    int len; // payload bytes
+};
+
+// CopyRect moves width x height pixels the client shows at src_x, src_y
+// to x, y, FillRect paints x, y, width, height in color, 0xRRGGBB.
+struct primitive_msg {
+    enum CommandType type;
+    int x;
+    int y;
+    int width;
+    int height;
+    int src_x; // CopyRect only
+    int src_y;
+    uint32_t color; // FillRect only
+};
+
+struct cursor_slot {
+    unsigned long serial; // XFixes cursor_serial the shape was last seen with
+    uint64_t hash; // of size and pixels, 0 when the slot is free
+    unsigned long used; // for picking a slot to reuse
+};
+
+struct cursor_cache {
+    struct cursor_slot slots[POINTER_CACHE_SLOTS];
+    unsigned long clock;
 };
 
 struct ppm_context {
@@ -67,26 +178,368 @@ struct ppm_context {
     char* fname;
 };
 
+struct sock_client {
+    int sock; // -1 when the slot is free
+    bool ready; // handshake done, gets the picture
+    unsigned long since; // connect time
+    struct out_msg* out_head; // not yet (completely) sent
+    struct out_msg* out_tail;
+    long queued; // bytes
+    char rbuf[MAX_COMMAND_LEN]; // partial command
+    int rlen;
+};
+
 struct sock_context {
     int listen_sock;
-    int sock;
+    struct sock_client clients[SOCK_MAX_CLIENTS];
+    int cmd_from; // client the last command came from, replies go there
+};
+
+// Head of the memfd shared with a local reader. Data is SHM_RING_HEAD_SIZE
+// bytes in and mapped twice back to back, so every message is contiguous
+// in memory even when it wraps. Messages are the wire protocol, a message
+// is published (write_pos moves) only once it's complete.
+struct shm_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // data bytes
+    uint64_t write_pos __attribute__((aligned(64))); // bytes published, writer only
+    uint32_t seq; // futex word, bumped on every publish
+    uint32_t sleeping; // reader is waiting on seq
+    uint64_t dropped; // readers cut off for falling behind
+    uint32_t writer_waiting; // writer wants the eventfd kicked when read_pos moves
+    uint64_t read_pos __attribute__((aligned(64))); // bytes consumed, reader only
+};
+
+struct shm_context {
+    int listen_sock; // unix socket the reader connects to for the memfd
+    int sock; // reader, -1 if none
+    bool ready; // reader is past its handshake
+    int memfd;
+    int wakefd; // eventfd handed over with the memfd, reader kicks it
+    struct shm_ring* ring;
+    char* data;
+    char rbuf[MAX_COMMAND_LEN];
+    int rlen;
+};
+
+enum RecType {
+    RecEnd, // preallocated space past the last record is zero
+    RecImage,
+    RecPointer,
+    RecCopy, // payload is int32_t src_x, src_y
+    RecFill, // payload is uint32_t color
+};
+
+// Recording file (-r), host byte order. The head is rewritten when the
+// recording is closed; until then index_off is 0 and the records have to
+// be walked up to the first RecEnd.
+struct rec_file_head {
+    char magic[8];
+    uint32_t version;
+    uint32_t screen_format; // as negotiated, images carry their own codec
+    uint32_t width;
+    uint32_t height;
+    uint64_t start_usec; // wall clock
+    uint64_t index_off; // rec_index_entry[index_cnt]
+    uint64_t index_cnt;
+    uint64_t data_end;
+};
+
+struct rec_entry { // 8 byte aligned, len bytes of payload follow
+    uint32_t type;
+    uint32_t len;
+    uint64_t usec; // since start_usec
+    int32_t x;
+    int32_t y;
+    int32_t width; // 0 for pointer moves
+    int32_t height;
+    uint32_t codec; // ImageCodec of images, PointerKind of pointers; payload is bare
+    uint32_t reserved;
+};
+
+struct rec_index_entry { // one per record
+    uint64_t off;
+    uint64_t usec;
+};
+
+struct rec_context {
+    int fd;
+    char* map; // window of the file being written
+    uint64_t map_off;
+    uint64_t map_len;
+    uint64_t pos; // end of records
+    uint64_t alloc_end; // preallocated up to here
+    struct rec_index_entry* index;
+    uint64_t index_cnt;
+    uint64_t index_size;
+    unsigned long start_usec; // monotonic
+    struct rec_file_head head;
 };
 
 #if WITH_USB
 struct usb_context {
     libusb_device_handle* hndl;
+    struct usb_out* out; // USB_OUT_XFERS bulk OUT transfers
+    struct usb_chunk* out_head; // queued, not submitted yet
+    struct usb_chunk* out_tail;
+    struct usb_chunk* spare;
+    long queued; // bytes queued or in flight
+    bool failed; // a transfer failed since the last write
+    struct usb_in* in; // control channel, posted once the handshake is done
 };
 #endif
 
+typedef void (*pixel_row_fn)(const uint8_t* src, uint8_t* dst, int width);
+
+enum RgbOrder {
+    RgbWire, // B, R, G as SF_RGB has always been sent
+    RgbTrue, // R, G, B for image codecs
+};
+
+enum PngFilter { // values are PNG filter types
+    PngFilterNone,
+    PngFilterSub,
+    PngFilterUp,
+    PngFilterAvg,
+    PngFilterPaeth,
+    PngFilterAdaptive, // pick per row
+};
+
+struct config { // -o name=value tunables
+    int png_level;
+    int png_filter;
+    int webp_lossless;
+    int webp_quality;
+    int webp_method;
+    int sock_sndbuf_kb; // 0 is system default
+    int sock_queue_kb; // client is dropped when this far behind
+    int backlog_kb; // hold damage while more than this is unsent, 0 never holds
+    int sock_clients; // viewers served at once, a new one replaces the oldest
+    int shm_size_mb; // data part of the shared memory ring
+    int pointer_hz; // pointer position updates per second, at most
+    int delta; // DeltaCompression for SF_DELTA
+    int background_ms; // damage outside the viewport waits this long, or for an idle link
+    int background_quality; // WebP quality it goes out at, refined later
+    int dither; // enum Dither
+};
+
 struct bmp_image_pump_context {
     XShmSegmentInfo shminfo;
     XImage* shmimage;
+    pixel_row_fn to_rgb; // NULL if the visual has no fast path
+    pixel_row_fn to_png;
+    bool argb_native; // pixels are already host order XRGB
 };
 
 struct webp_image_pump_context {
     struct bmp_image_pump_context bmp;
     WebPConfig config;
+    WebPConfig lossless; // SF_MIXED only, config is then lossy
+    WebPConfig coarse; // lossy at background_quality
+    int formats; // SF_MIXED only, what the client can decode
+};
+
+struct png_encoder {
+    z_stream zs;
+    bool ready;
+    int level;
+    char* rows; // raw and filtered rows
+    int row_len;
+};
+
+struct encoder { // per encoder thread state
     WebPPicture picture;
+    bool picture_ready;
+    struct png_encoder png;
+    char* rgb; // scratch for visuals without a fast path
+    int rgb_size;
+    char* argb; // opaque copy of the rect for WebP
+    int argb_size;
+    bool replace; // SF_DELTA rect the client doesn't have a picture under
+    bool coarse; // outside the viewport, lossy WebP at background_quality
+    int x; // where the rect is on screen, for the dither pattern
+    int y;
+#if WITH_ZSTD
+    ZSTD_CCtx* zstd;
+#endif
+};
+
+enum TracePoint { // usec timestamps every message collects on its way out
+    TpEvent, // oldest X damage event in the capture
+    TpCapture, // capture started
+    TpQueued, // pixels copied, job waits for an encoder
+    TpEncodeStart,
+    TpEncoded,
+    TpSent, // handed to the transport, in order
+    TpDone, // transport queue drained (upper bound)
+    TracePoints,
+};
+
+enum JobType {
+    JobImage,
+    JobPointer,
+    JobPrimitive,
+};
+
+struct job {
+    int state;
+    enum JobType type;
+    int x;
+    int y;
+    int width;
+    int height;
+    char* pixels; // rect copied out of framebuffer
+    int pixels_size;
+    int stride;
+    char* buf; // DATA_BUFFER_HEAD + encoded data
+    int buf_size;
+    int len;
+    bool replace; // see struct encoder
+    bool coarse;
+    enum PointerKind kind; // pointer jobs only
+    int slot;
+    struct primitive_msg prim; // primitive jobs only
+    int encoder; // worker index
+    unsigned long stamp[TpDone]; // TpEvent .. TpEncoded
+};
+
+struct job_cell {
+    unsigned long seq;
+    struct job* job;
+};
+
+struct job_queue {
+    struct job_cell cells[PIPELINE_DEPTH];
+    unsigned long enq __attribute__((aligned(64)));
+    unsigned long deq __attribute__((aligned(64)));
+    sem_t items;
+};
+
+struct worker {
+    pthread_t thread;
+    struct pipeline* pl;
+    struct encoder enc;
+};
+
+struct pipeline {
+    struct context* ctx;
+    struct job ring[PIPELINE_DEPTH]; // jobs in capture order
+    unsigned long head; // oldest job not sent yet
+    unsigned long tail; // next free slot
+    struct job_queue queue; // jobs waiting for an encoder
+    int done_fd; // eventfd, bumped by workers on every finished job
+    struct worker* workers;
+    int nworkers;
+    bool discard; // drop finished jobs instead of sending them
+    unsigned long t_event; // of the capture going on, see pipeline_begin_capture
+    unsigned long t_capture;
+    bool coarse; // of the capture going on
+};
+
+struct histogram { // log-linear buckets of usec, HDR style
+    uint32_t counts[TRACE_HIST_BUCKETS];
+    unsigned long cnt;
+    unsigned long max;
+};
+
+struct trace_rec {
+    unsigned long stamp[TracePoints];
+    int x;
+    int y;
+    int width;
+    int height;
+    int len;
+    char type; // JobType
+    char encoder;
+};
+
+// Stage i runs from TracePoint i to i + 1, the last one is the total.
+struct trace {
+    struct histogram hist[TracePoints];
+    struct trace_rec* ring; // last TRACE_RING_SIZE messages
+    unsigned long head; // next record
+    unsigned long undone; // oldest record still in the transport
+    const char* path; // trace dump, NULL if none
+};
+
+// Counters every thread bumps in a block of its own, see stats.c. The
+// gauges at the end are set by the pump.
+enum Metric {
+    MetricCapturedBytes,
+    MetricUnchangedBytes, // damaged, but identical to what was sent
+    MetricDamageRects,
+    MetricCoalesced, // damage rects merged into another one before capture
+    MetricDiscarded, // encoded jobs thrown away on a scene change
+    MetricDroppedViewers,
+    MetricSentImages,
+    MetricSentPointers,
+    MetricSentCopies,
+    MetricSentFills,
+    MetricSentBytes,
+    MetricSendFailures,
+    MetricUsbErrors,
+    MetricUsbRetries,
+    MetricCodecRects, // + ImageCodec
+    MetricCodecRaw = MetricCodecRects + IMAGE_CODECS, // rect size as 24 bit RGB
+    MetricCodecBytes = MetricCodecRaw + IMAGE_CODECS, // encoded
+    MetricQueuedBytes = MetricCodecBytes + IMAGE_CODECS,
+    MetricJobs, // in the pipeline
+    MetricFailCnt,
+    Metrics,
+};
+
+enum LoopEvent { // bit masks
+    LoopX = 0x1,
+    LoopPointer = 0x2,
+    LoopFrame = 0x4,
+    LoopDone = 0x8,
+    LoopTransport = 0x10,
+    LoopSignal = 0x20,
+    LoopDump = 0x40, // SIGUSR1, write the trace
+};
+
+struct event_loop {
+    int epfd;
+    int pointer_timer;
+    int frame_timer;
+    int signal_fd;
+    unsigned long frame_deadline; // 0 when the frame timer is off
+    unsigned long pointer_deadline; // same for the pointer timer
+    struct pollfd transport[LOOP_MAX_TRANSPORT_FDS]; // as registered with epoll
+    int transport_cnt;
+};
+
+struct damage_region {
+    XRectangle rects[DAMAGE_MAX_RECTS];
+    int cnt;
+    int rect_cost; // per-message overhead, in pixels
+    unsigned long superseded; // updates overwritten by newer damage before capture
+    unsigned long since; // now_usec() of the oldest event in rects
+};
+
+// What the client looks at, Viewport command. Without one (width 0) the
+// whole screen is in view.
+struct viewport {
+    XRectangle r;
+    int gaze_x; // -1 if the client doesn't track it, the pointer stands in
+    int gaze_y;
+};
+
+struct framebuffer {
+    char* pixels; // what the client shows, in X server pixel format
+    int width;
+    int height;
+    int bpp; // bytes per pixel
+    int stride;
+    int tiles_x;
+    int tiles_y;
+    char* valid; // per tile: client has exactly our pixels
+    char* forced; // per tile: taken over without comparing by the last fb_update
+    char* prev; // what the last fb_update overwrote, SF_DELTA sessions only
+    XRectangle* changed; // output of fb_update
+    unsigned long damaged_bytes;
+    unsigned long dropped_bytes; // damaged, but identical to what was sent
 };
 
 struct context {
@@ -95,11 +548,38 @@ struct context {
     int damage_evt_base;
     int cursor_evt_base;
     int fin;
+    int fail_cnt;
     short cursor_x;
     short cursor_y;
+    int xi_opcode; // XInputExtension, -1 if the pointer has to be polled
+    bool pointer_moved; // raw motion seen since the position was last sent
+    unsigned long pointer_at; // now() of that
+    int frame_interval; // msec between damage flushes
+    int screen_format; // as negotiated
+    int pointer_format; // PointerFormat bits, as negotiated
+    struct config cfg;
+    struct damage_region damage; // in the viewport, goes out every frame
+    struct damage_region background; // outside, waits
+    struct damage_region refine; // went out coarse, resent once the link is idle
+    struct viewport view;
+    struct framebuffer fb;
+    struct pipeline pl;
+    struct event_loop loop;
+    struct trace trace;
+    struct cursor_cache cursors; // what the client has in its PF_CACHE slots
+    struct png_encoder cursor_png;
+    char* cursor_buf; // PNG of the shape being sent
+    int cursor_buf_size;
+    char* motion_buf; // line hashes for scroll detection
+    int motion_buf_size;
+    int scale; // the fb is the root window shrunk by this much
+    char* scaled; // a captured rect after downscaling
+    int scaled_size;
     union writer_cfg {
         struct sock_context sctx;
         struct ppm_context pctx;
+        struct shm_context mctx;
+        struct rec_context rctx;
 #if WITH_USB
         struct usb_context uctx;
 #endif
@@ -109,24 +589,121 @@ struct context {
         struct webp_image_pump_context webp;
     } p;
     bool (*init_conn)(struct context*, char*, int);
-    bool (*check_reinit)(struct context*, char*, int);
+    int (*read_command)(struct context*, char*, int); // next client command, 0 if none
     bool (*send_reply)(struct context*, char*, int);
     bool (*write_image)(struct context*, int, int, int, int, char*, int);
-    bool (*write_pointer)(struct context*, int, int, int, int, char*);
+    bool (*write_pointer)(struct context*, const struct pointer_msg*, char*);
+    bool (*write_primitive)(struct context*, const struct primitive_msg*); // NULL if never offered
     bool (*change_scene)(struct context*);
     bool (*recenter)(struct context*, int, int);
-    int (*get_image)(struct context*, char*, int, int, int, int);
+    int (*encode_image)(struct context*, struct encoder*, char*, int, char*, int, int, int);
+    bool (*flush_out)(struct context*); // write out what's queued, NULL if nothing ever is
+    int (*poll_fds)(struct context*, struct pollfd*, int); // transport fds for the pump
+    long (*out_queued)(struct context*); // bytes accepted but not written yet
+    int (*out_peers)(struct context*); // viewers other than the one talking now
+    void (*close_out)(struct context*); // on the way out, NULL if nothing to do
 };
 
 
 void slog(int, char*, ...);
-char* fill_imagecmd_header(char*, int, int, int, int, int);
+void set_log_level(int);
+bool config_set(struct config*, const char* opt);
+void config_defaults(struct config*);
+void encoder_visual(struct context*, XImage* shmimage);
+int encoder_format(int formats);
+bool init_encoder(struct context*, int format);
+void fill_imagecmd_header(char* cmd, int data_len, int w, int h, int x, int y);
+int fill_pointercmd_header(char* cmd, const struct pointer_msg*);
+int pointercmd_len(const struct pointer_msg*);
+int fill_primcmd_header(char* cmd, const struct primitive_msg*);
+int primcmd_len(const struct primitive_msg*);
 unsigned long now();
+unsigned long now_usec();
+void update_fail_cnt(struct context*, bool);
+int command_len(const char* buf, int len);
+int recv_command(int fd, char* rbuf, int* rlen, char* buf, int size);
 #if WITH_USB
 void init_usb(struct context*, int bus, int port);
 #endif
-bool dummy_pointer_writer(struct context*, int, int, int, int, char*);
+bool dummy_pointer_writer(struct context*, const struct pointer_msg*, char*);
 void init_ppm(struct context*, char*);
 void init_socket(struct context*, uint16_t);
+void init_shm(struct context*, const char* path);
+void init_rec(struct context*, const char* path);
+pixel_row_fn select_rgb_converter(const XImage*, enum RgbOrder);
+void rgb_row_copy(const uint8_t* src, uint8_t* dst, int width);
+void rgba_row_copy(const uint8_t* src, uint8_t* dst, int width);
+void convert_rgb(pixel_row_fn, const char* src, int src_stride
+                 , char* dst, int width, int height);
+void convert_ximage_rgb(XImage*, pixel_row_fn, enum RgbOrder
+                        , char* out, int width, int height);
+bool is_native_argb(const XImage*);
+void convert_ximage_argb(XImage*, bool native, uint32_t* out, int width, int height);
+void cursor_to_rgba(const unsigned long* src, char* rgba, int count);
+uint32_t pixel_rgb(const XImage*, const char* pixel);
+void convert_yuv420(const char* bgrx, int stride, char* out, int width, int height);
+void convert_rgb565(const char* bgrx, int stride, char* out, int width, int height
+                    , int x, int y, bool dither);
+void downscale(const char* src, int src_stride, char* dst, int dst_stride
+               , int width, int height, int scale, int bpp);
+enum ImageCodec classify_rect(XImage*, bool native);
+bool fb_init(struct framebuffer*, int width, int height, int bpp);
+void fb_free(struct framebuffer*);
+void fb_invalidate(struct framebuffer*);
+void fb_invalidate_rect(struct framebuffer*, int x, int y, int width, int height);
+bool fb_keep_previous(struct framebuffer*);
+bool fb_forced(const struct framebuffer*, int x, int y, int width, int height);
+bool fb_valid(const struct framebuffer*, int x, int y, int width, int height);
+bool fb_scale_rect(const struct framebuffer*, int scale, XRectangle*);
+void fb_copy(struct framebuffer*, int x, int y, int width, int height, int src_x, int src_y);
+char* fb_pixels(struct framebuffer*, int x, int y);
+int fb_update(struct framebuffer*, const char* src, int src_stride
+              , int x, int y, int width, int height);
+bool png_encoder_reset(struct png_encoder*, int level);
+int png_encode(struct png_encoder*, int level, int filter, char* out, int out_size
+               , const char* src, int stride, int width, int height
+               , pixel_row_fn row_fn, int bpp);
+bool reserve_buffer(char** buf, int* size, int need);
+bool pipeline_init(struct context*, int workers);
+void pipeline_begin_capture(struct context*, unsigned long event_usec, bool coarse);
+bool pipeline_submit_image(struct context*, int x, int y, int width, int height);
+bool pipeline_submit_pointer(struct context*, const struct pointer_msg*, const char* data);
+bool pipeline_submit_primitive(struct context*, const struct primitive_msg*);
+void pipeline_send_ready(struct context*);
+void pipeline_drain(struct context*);
+void pipeline_discard(struct context*);
+void pipeline_stop(struct context*);
+void loop_block_signals();
+bool loop_init(struct event_loop*, int x_fd);
+bool loop_watch_done(struct event_loop*, int done_fd);
+void loop_set_frame(struct event_loop*, unsigned long deadline);
+void loop_set_pointer(struct event_loop*, unsigned long deadline);
+unsigned loop_wait(struct context*, struct event_loop*);
+bool motion_copy(struct context*, const char* src, int src_stride
+                 , int x, int y, int width, int height);
+void damage_init(struct damage_region*, int rect_cost);
+void damage_add(struct damage_region*, int x, int y, int width, int height);
+bool damage_empty(const struct damage_region*);
+void damage_clear(struct damage_region*);
+void damage_requeue(struct damage_region*, int x, int y, int width, int height);
+void damage_add_split(struct damage_region* in, struct damage_region* out, const XRectangle* view
+                      , int x, int y, int width, int height);
+void damage_move(struct damage_region* from, struct damage_region* in, struct damage_region* out
+                 , const XRectangle* view);
+void damage_sort(struct damage_region*, int x, int y);
+bool trace_init(struct trace*, const char* path);
+void trace_sent(struct trace*, const struct job*);
+void trace_transport(struct context*);
+void trace_log(struct trace*);
+bool trace_dump(struct trace*);
+void cursor_cache_reset(struct cursor_cache*);
+uint64_t cursor_hash(const char* rgba, int width, int height);
+int cursor_cache_find(struct cursor_cache*, unsigned long serial);
+int cursor_cache_put(struct cursor_cache*, unsigned long serial, uint64_t hash, bool* fresh);
+bool stats_init(const char* path);
+void stats_thread();
+void stats_gauges(struct context*);
+void metric_add(enum Metric, unsigned long);
+void metric_set(enum Metric, unsigned long);
 
 #endif //__X_VIREDERO_H__